@@ -24,8 +24,34 @@ const int MAX_FRAMES_IN_FLIGHT = 2;
 #include <fstream>
 #include <filesystem>
 #include <semaphore>
+#include <chrono>
+#include <array>
+#include <string>
 
 class VulkanContext final {
+public:
+    // 命令行参数，格式是--名字 数字
+    struct Options final {
+        bool directDispatch = true; // 录制和提交用vkGetDeviceProcAddr拿到的函数指针，为false的时候用loader导出的函数
+        uint32_t dispatchBenchmarkDraws = 0; // 不为0的时候测试两种函数表录制这么多个draw的耗时，测完就退出
+
+        static Options FromArgs(int argc, char** argv) {
+            Options options;
+            for (int i = 1; i + 1 < argc; i += 2) {
+                std::string name = argv[i];
+                auto value = static_cast<uint32_t>(std::stoul(argv[i + 1]));
+                if (name == "--direct-dispatch") {
+                    options.directDispatch = value != 0;
+                } else if (name == "--dispatch-bench") {
+                    options.dispatchBenchmarkDraws = value;
+                } else {
+                    throw std::runtime_error("unknown option: " + name);
+                }
+            }
+            return options;
+        }
+    };
+
 private:
     struct SwapChainSupportDetails {
         VkSurfaceCapabilitiesKHR capabilities;
@@ -41,6 +67,26 @@ private:
     GLFWwindow* window = nullptr;
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     VkDevice logicalDevice = VK_NULL_HANDLE;
+    Options options;
+    // 直接用vkCmdDraw这些函数的话，调的是loader导出的函数，loader还要再跳一次才到驱动里面
+    // 逻辑设备创建好之后用vkGetDeviceProcAddr把每一帧都要用的函数地址拿出来，录制和提交都走这个表
+    // options.directDispatch为false的时候表里面放的就是loader导出的函数，用来和直接调用对比
+    struct DeviceDispatch {
+        PFN_vkBeginCommandBuffer vkBeginCommandBuffer = nullptr;
+        PFN_vkEndCommandBuffer vkEndCommandBuffer = nullptr;
+        PFN_vkResetCommandBuffer vkResetCommandBuffer = nullptr;
+        PFN_vkCmdBeginRenderPass vkCmdBeginRenderPass = nullptr;
+        PFN_vkCmdEndRenderPass vkCmdEndRenderPass = nullptr;
+        PFN_vkCmdBindPipeline vkCmdBindPipeline = nullptr;
+        PFN_vkCmdSetViewport vkCmdSetViewport = nullptr;
+        PFN_vkCmdSetScissor vkCmdSetScissor = nullptr;
+        PFN_vkCmdDraw vkCmdDraw = nullptr;
+        PFN_vkWaitForFences vkWaitForFences = nullptr;
+        PFN_vkResetFences vkResetFences = nullptr;
+        PFN_vkAcquireNextImageKHR vkAcquireNextImageKHR = nullptr;
+        PFN_vkQueueSubmit vkQueueSubmit = nullptr;
+        PFN_vkQueuePresentKHR vkQueuePresentKHR = nullptr;
+    } deviceDispatch;
     std::optional<uint32_t> graphicsQueueFamilyIndex;
     std::optional<uint32_t> presentQueueFamilyIndex;
     VkQueue graphicsQueue; // 进行图像处理的队列
@@ -59,7 +105,7 @@ private:
     std::vector<VkCommandBuffer> commandBuffers;
     bool framebufferResized = false;
 
-    VulkanContext(int width = 800, int height = 600){
+    VulkanContext(const Options& options, int width = 800, int height = 600) : options(options) {
         // 在构造函数中来实现Vulkan的整体流程
         // vkInstanceCreateInfo是C语言的写法，然后C++的写法就是vk::InstanceCreateInfo{}，但是这种写法是使用原生的vulkan头文件，我这边使用的是glfw框架来实现跨平台的操作
         // vk::InstanceCreateInfo createInfo{}; 
@@ -69,8 +115,8 @@ private:
     }
     VulkanContext(const VulkanContext&) = delete;
     VulkanContext& operator=(const VulkanContext&) = delete;
-    static void CreateInstance(){
-        _ins.reset(new VulkanContext);
+    static void CreateInstance(const Options& options){
+        _ins.reset(new VulkanContext(options));
     }
 
     void CreateVulkanInstance(){
@@ -206,6 +252,10 @@ private:
         Init();
     }
     void MainLoop(){
+        if (options.dispatchBenchmarkDraws > 0) {
+            RunDispatchBenchmark(options.dispatchBenchmarkDraws);
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+        }
         while(!glfwWindowShouldClose(window)) {
             glfwPollEvents();
             Update();
@@ -293,9 +343,34 @@ private:
             throw std::runtime_error("failed to create logical device!");
         }
         std::cout << "logical device created successfully" << std::endl;
+        LoadDeviceDispatch(deviceDispatch, options.directDispatch);
         vkGetDeviceQueue(logicalDevice, graphicsQueueFamilyIndex.value(), 0, &graphicsQueue);
         vkGetDeviceQueue(logicalDevice, presentQueueFamilyIndex.value(), 0, &presentQueue);
     }
+    // 必须在vkCreateDevice之后调用，拿不到的函数说明驱动有问题，直接报错
+    template<typename T>
+    void LoadDeviceFunction(T& function, const char* name, T loaderFunction, bool direct){
+        function = direct ? reinterpret_cast<T>(vkGetDeviceProcAddr(logicalDevice, name)) : loaderFunction;
+        if (function == nullptr) {
+            throw std::runtime_error(std::string("failed to load device function ") + name);
+        }
+    }
+    void LoadDeviceDispatch(DeviceDispatch& dispatch, bool direct){
+        LoadDeviceFunction(dispatch.vkBeginCommandBuffer, "vkBeginCommandBuffer", ::vkBeginCommandBuffer, direct);
+        LoadDeviceFunction(dispatch.vkEndCommandBuffer, "vkEndCommandBuffer", ::vkEndCommandBuffer, direct);
+        LoadDeviceFunction(dispatch.vkResetCommandBuffer, "vkResetCommandBuffer", ::vkResetCommandBuffer, direct);
+        LoadDeviceFunction(dispatch.vkCmdBeginRenderPass, "vkCmdBeginRenderPass", ::vkCmdBeginRenderPass, direct);
+        LoadDeviceFunction(dispatch.vkCmdEndRenderPass, "vkCmdEndRenderPass", ::vkCmdEndRenderPass, direct);
+        LoadDeviceFunction(dispatch.vkCmdBindPipeline, "vkCmdBindPipeline", ::vkCmdBindPipeline, direct);
+        LoadDeviceFunction(dispatch.vkCmdSetViewport, "vkCmdSetViewport", ::vkCmdSetViewport, direct);
+        LoadDeviceFunction(dispatch.vkCmdSetScissor, "vkCmdSetScissor", ::vkCmdSetScissor, direct);
+        LoadDeviceFunction(dispatch.vkCmdDraw, "vkCmdDraw", ::vkCmdDraw, direct);
+        LoadDeviceFunction(dispatch.vkWaitForFences, "vkWaitForFences", ::vkWaitForFences, direct);
+        LoadDeviceFunction(dispatch.vkResetFences, "vkResetFences", ::vkResetFences, direct);
+        LoadDeviceFunction(dispatch.vkAcquireNextImageKHR, "vkAcquireNextImageKHR", ::vkAcquireNextImageKHR, direct);
+        LoadDeviceFunction(dispatch.vkQueueSubmit, "vkQueueSubmit", ::vkQueueSubmit, direct);
+        LoadDeviceFunction(dispatch.vkQueuePresentKHR, "vkQueuePresentKHR", ::vkQueuePresentKHR, direct);
+    }
     void CreateSurface(){
         // VkWin32SurfaceCreateInfoKHR createInfo{};
         // createInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
@@ -755,13 +830,14 @@ private:
         }
         std::cout << "command buffer created successfully" << std::endl;
     }
-    void RecordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex){
+    // dispatch平时就是deviceDispatch，drawCount平时是1，RunDispatchBenchmark会传别的函数表和很多个draw进来
+    void RecordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, const DeviceDispatch& dispatch, uint32_t drawCount = 1){
         VkCommandBufferBeginInfo beginInfo{};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         beginInfo.flags = 0; // Optional
         beginInfo.pInheritanceInfo = nullptr; // Optional
         
-        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        if (dispatch.vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
             throw std::runtime_error("failed to begin recording command buffer!");
         }
 
@@ -774,8 +850,8 @@ private:
         VkClearValue clearColor = {{{82.0f / 255.0f, 82.0f / 255.0f, 136.0f / 255.0f, 1.0f}}};
         renderPassInfo.clearValueCount = 1;
         renderPassInfo.pClearValues = &clearColor; // 定义背景颜色，也就是OpenGL中的clear color
-        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline); // 第二个参数指定pipeline类型，一种图形管道用来渲染图形，一种计算管道用来并行计算
+        dispatch.vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        dispatch.vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline); // 第二个参数指定pipeline类型，一种图形管道用来渲染图形，一种计算管道用来并行计算
         
         // 前面将viewport和scissor都设置成了动态属性了，所以需要在这里设置这两玩意
         VkViewport viewport{};
@@ -785,26 +861,59 @@ private:
         viewport.height = static_cast<float>(swapChainExtent.height);
         viewport.minDepth = 0.0f;
         viewport.maxDepth = 1.0f;
-        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+        dispatch.vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
 
         VkRect2D scissor{};
         scissor.offset = {0, 0};
         scissor.extent = swapChainExtent;
-        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+        dispatch.vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+        for (uint32_t i = 0; i < drawCount; ++i) {
+            dispatch.vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+        }
         // 第一参数懂的都懂
         // 第二个参数是vertex count，也就是顶点数量
         // 第三个参数是instance count，也就是实例数量，不用instance就设置为1
         // 第四个参数是起始vertex index，也就是gl_VertexIndex的起始值，也能说是偏移值
         // 第五个参数是起始instance index，也就是gl_InstanceIndex的起始值，也能说是偏移值
 
-        vkCmdEndRenderPass(commandBuffer);
+        dispatch.vkCmdEndRenderPass(commandBuffer);
 
-        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        if (dispatch.vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
             throw std::runtime_error("failed to record command buffer!");
         }   
     }
+    // 同样录制drawCount个draw，分别用loader导出的函数和vkGetDeviceProcAddr拿到的函数，只计CPU录制的时间，不提交
+    // 两种函数表交替测，避免CPU频率变化只影响其中一种
+    void RunDispatchBenchmark(uint32_t drawCount){
+        DeviceDispatch loaderDispatch;
+        LoadDeviceDispatch(loaderDispatch, false);
+        DeviceDispatch directDispatch;
+        LoadDeviceDispatch(directDispatch, true);
+        const std::array<std::pair<const char*, const DeviceDispatch*>, 2> dispatches = {{ { "loader", &loaderDispatch }, { "direct", &directDispatch } }};
+
+        const int iterations = 20;
+        std::array<double, 2> totalMs = {};
+        auto commandBuffer = commandBuffers[0];
+        for (int i = -1; i < iterations; ++i) { // 第-1次是预热，不计时
+            for (size_t j = 0; j < dispatches.size(); ++j) {
+                const auto& dispatch = *dispatches[j].second;
+                dispatch.vkResetCommandBuffer(commandBuffer, 0);
+                auto startTime = std::chrono::steady_clock::now();
+                RecordCommandBuffer(commandBuffer, 0, dispatch, drawCount);
+                if (i >= 0) totalMs[j] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+            }
+        }
+        vkResetCommandBuffer(commandBuffer, 0);
+        std::cout << "Dispatch benchmark: " << drawCount << " draws, " << iterations << " iterations" << std::endl;
+        for (size_t j = 0; j < dispatches.size(); ++j) {
+            auto averageMs = totalMs[j] / iterations;
+            std::cout << "  " << dispatches[j].first << ": " << averageMs << " ms per frame, "
+                      << averageMs * 1e6 / drawCount << " ns per draw" << std::endl;
+        }
+        std::cout << "  direct saves " << (totalMs[0] - totalMs[1]) / iterations << " ms per frame" << std::endl;
+    }
+
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
     std::vector<VkFence> inFlightFences;
@@ -841,19 +950,19 @@ private:
         // 同步机制分为两种：一种是信号量，一种是Fance栅栏
         // 信号量是一种非阻塞的同步机制，有点像事件触发机制，不会阻塞当前线程，而是满足某些条件之后才触发某些逻辑
         // Fance栅栏是一种阻塞的同步机制，在wait的过程会阻塞当前线程，知道满足Fance的条件才会往下执行
-        vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX); // 等待上一帧渲染完成
+        deviceDispatch.vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX); // 等待上一帧渲染完成
         uint32_t imageIndex;
-        auto result = vkAcquireNextImageKHR(logicalDevice, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+        auto result = deviceDispatch.vkAcquireNextImageKHR(logicalDevice, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
         if (result == VK_ERROR_OUT_OF_DATE_KHR) {
             RecreateSwapChain();
             return;
         } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
             throw std::runtime_error("failed to acquire swap chain image!");
         }
-        vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
+        deviceDispatch.vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
 
-        vkResetCommandBuffer(commandBuffers[currentFrame], 0);
-        RecordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+        deviceDispatch.vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+        RecordCommandBuffer(commandBuffers[currentFrame], imageIndex, deviceDispatch);
 
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -867,7 +976,7 @@ private:
         VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
         submitInfo.signalSemaphoreCount = 1;
         submitInfo.pSignalSemaphores = signalSemaphores;
-        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
+        if (deviceDispatch.vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
             throw std::runtime_error("failed to submit draw command buffer!");
         }
 
@@ -882,7 +991,7 @@ private:
         presentInfo.pImageIndices = &imageIndex;
         presentInfo.pResults = nullptr; // Optional
 
-        result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        result = deviceDispatch.vkQueuePresentKHR(presentQueue, &presentInfo);
         if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
             framebufferResized = false;
             std::cout << "window resized, swap chain recreated successfully" << std::endl;
@@ -973,8 +1082,8 @@ private:
 
 
 public:
-    static VulkanContext* GetInstance(){
-        std::call_once(_init_flag, CreateInstance); // 线程安全的
+    static VulkanContext* GetInstance(const Options& options = Options()){
+        std::call_once(_init_flag, CreateInstance, options); // 线程安全的
         return _ins.get();
     }
     ~VulkanContext(){}
@@ -1,6 +1,6 @@
 #include "VulkanContext.hpp"
 
-int main() {
-    VulkanContext::GetInstance();
+int main(int argc, char** argv) {
+    VulkanContext::GetInstance(VulkanContext::Options::FromArgs(argc, argv));
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include "VulkanContext.hpp"
+
+// 帧时间性能测试：每个场景用自己的配置完整地跑一次渲染器，把结果写成JSON，方便比较不同版本的性能
+// 用法: LearnVulkanBench [--frames 500] [--warmup 50] [--scene 名字] [--windowed 1] [--out bench_results.json]
+
+struct Scene final {
+    std::string name;
+    uint32_t triangleCount;
+    uint32_t drawCount;
+    uint32_t framesInFlight;
+    vk::PresentModeKHR presentMode; // 只有--windowed 1的时候才有意义
+};
+
+static const std::vector<Scene> SCENES = {
+    { "triangle",           1,       1,     2, vk::PresentModeKHR::eImmediate },
+    { "many_draws",         10000,   10000, 2, vk::PresentModeKHR::eImmediate },
+    { "many_triangles",     1000000, 1,     2, vk::PresentModeKHR::eImmediate },
+    { "many_draws_fif1",    10000,   10000, 1, vk::PresentModeKHR::eImmediate },
+    { "many_draws_fif3",    10000,   10000, 3, vk::PresentModeKHR::eImmediate },
+    { "many_draws_mailbox", 10000,   10000, 2, vk::PresentModeKHR::eMailbox },
+    { "many_draws_fifo",    10000,   10000, 2, vk::PresentModeKHR::eFifo },
+};
+
+static void WriteStats(std::ostream& out, const FrameStats& stats) {
+    out << "{\"min\":" << stats.Min() << ",\"avg\":" << stats.Average()
+        << ",\"p50\":" << stats.Percentile(50) << ",\"p90\":" << stats.Percentile(90)
+        << ",\"p99\":" << stats.Percentile(99) << ",\"max\":" << stats.Max() << "}";
+}
+
+static void WriteScene(std::ostream& out, const Scene& scene, const VulkanContext::RunReport& report) {
+    out << "    {\n"
+        << "      \"name\": \"" << scene.name << "\",\n"
+        << "      \"triangles\": " << scene.triangleCount << ",\n"
+        << "      \"draws\": " << scene.drawCount << ",\n"
+        << "      \"framesInFlight\": " << scene.framesInFlight << ",\n"
+        << "      \"presentMode\": \"" << vk::to_string(scene.presentMode) << "\",\n"
+        << "      \"frames\": " << report.frames << ",\n"
+        << "      \"initMs\": " << report.initMs << ",\n"
+        << "      \"firstFrameMs\": " << report.firstFrameMs << ",\n"
+        << "      \"cpuFrameMs\": ";
+    WriteStats(out, report.cpuFrameMs);
+    out << ",\n      \"frameIntervalMs\": ";
+    WriteStats(out, report.frameIntervalMs);
+    out << ",\n      \"gpuMs\": {";
+    for (size_t i = 0; i < report.gpu.size(); ++i) {
+        const auto& gpu = report.gpu[i];
+        out << (i > 0 ? "," : "") << "\"" << gpu.name << "\":{\"min\":" << gpu.min << ",\"avg\":" << gpu.average
+            << ",\"p99\":" << gpu.p99 << ",\"max\":" << gpu.max << "}";
+    }
+    out << "},\n"
+        << "      \"memory\": {\"deviceMemoryCount\":" << report.memory.deviceMemoryCount
+        << ",\"vkAllocateMemoryCalls\":" << report.memory.totalAllocateCalls
+        << ",\"allocations\":" << report.memory.allocationCount
+        << ",\"usedBytes\":" << report.memory.usedBytes
+        << ",\"reservedBytes\":" << report.memory.reservedBytes << "}\n"
+        << "    }";
+}
+
+int main(int argc, char** argv) {
+    uint32_t frames = 500;
+    uint32_t warmup = 50;
+    bool windowed = false;
+    std::string sceneFilter;
+    std::string outPath = "bench_results.json";
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        std::string value = argv[i + 1];
+        if (name == "--frames") {
+            frames = static_cast<uint32_t>(std::stoul(value));
+        } else if (name == "--warmup") {
+            warmup = static_cast<uint32_t>(std::stoul(value));
+        } else if (name == "--scene") {
+            sceneFilter = value;
+        } else if (name == "--windowed") {
+            windowed = value != "0";
+        } else if (name == "--out") {
+            outPath = value;
+        } else {
+            std::cerr << "unknown option: " << name << std::endl;
+            return 1;
+        }
+    }
+
+    std::ofstream out(outPath);
+    if (!out.is_open()) {
+        std::cerr << "failed to open " << outPath << std::endl;
+        return 1;
+    }
+    out << std::fixed << std::setprecision(4);
+    out << "{\n  \"frames\": " << frames << ",\n  \"warmup\": " << warmup << ",\n  \"headless\": " << (windowed ? "false" : "true") << ",\n  \"scenes\": [\n";
+    bool first = true;
+    for (const auto& scene : SCENES) {
+        if (!sceneFilter.empty() && scene.name != sceneFilter) continue;
+        std::cout << "Running scene " << scene.name << std::endl;
+        auto options = VulkanContext::Options();
+        options.headless = !windowed;
+        options.triangleCount = scene.triangleCount;
+        options.drawCount = scene.drawCount;
+        options.framesInFlight = scene.framesInFlight;
+        options.presentMode = scene.presentMode;
+        options.frameCount = warmup + frames;
+        options.warmupFrames = warmup;
+        options.gpuProfile = true;
+        options.collectReport = true;
+        auto report = VulkanContext::Run(options);
+        out << (first ? "" : ",\n");
+        WriteScene(out, scene, report);
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+    std::cout << "Results written to " << outPath << std::endl;
+    return 0;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <type_traits>
+
+#include "GpuTimeline.hpp"
+#include "MemoryAllocator.hpp"
+
+// 延迟销毁队列：运行时不再需要的Vulkan对象和显存连同最后一次使用它的timeline值一起放进来，
+// GPU执行过这个值之后再真正销毁，这样运行时释放资源(重建交换链、流式加载)都不需要device.waitIdle
+// 每一帧只销毁有限个对象，一次释放一大堆资源的时候不会让某一帧特别卡
+// 对象按放进来的顺序销毁(同一个值的情况下)，所以有依赖的对象要先放依赖别人的那个，比如先framebuffer再image view
+class DeletionQueue final {
+public:
+    static constexpr size_t DEFAULT_BUDGET = 64; // 每一帧最多销毁多少个对象
+
+    void Init(vk::Device device, MemoryAllocator& allocator, GpuTimeline& timeline) {
+        this->device = device;
+        this->allocator = &allocator;
+        this->timeline = &timeline;
+    }
+
+    // 销毁队列里所有的对象，调用之前GPU必须是空闲的
+    void Destroy() {
+        while (!entries.empty()) {
+            DestroyEntry(entries.front());
+            entries.pop_front();
+        }
+    }
+
+    // 任何vulkan.hpp的设备级handle，空handle直接忽略
+    template<typename Handle>
+    void Push(Handle handle, uint64_t timelineValue) {
+        static_assert(IsSupported(Handle::objectType), "DeletionQueue does not know how to destroy this handle type");
+        if (!handle) return;
+        Entry entry;
+        entry.timelineValue = timelineValue;
+        entry.type = Handle::objectType;
+        entry.handle = ToRaw(static_cast<typename Handle::CType>(handle));
+        Insert(entry);
+    }
+
+    // buffer和它的显存一起释放，调用之后传进来的buffer会被清空
+    void Push(AllocatedBuffer& buffer, uint64_t timelineValue) {
+        Entry entry;
+        entry.timelineValue = timelineValue;
+        entry.type = vk::ObjectType::eBuffer;
+        entry.handle = ToRaw(static_cast<VkBuffer>(buffer.buffer));
+        entry.allocation = buffer.allocation;
+        Insert(entry);
+        buffer = AllocatedBuffer();
+    }
+
+    void Push(AllocatedImage& image, uint64_t timelineValue) {
+        Entry entry;
+        entry.timelineValue = timelineValue;
+        entry.type = vk::ObjectType::eImage;
+        entry.handle = ToRaw(static_cast<VkImage>(image.image));
+        entry.allocation = image.allocation;
+        Insert(entry);
+        image = AllocatedImage();
+    }
+
+    // 只释放一段子分配的显存，比如资源已经销毁了但是还有别的资源别名到这块内存上
+    void Push(Allocation& allocation, uint64_t timelineValue) {
+        Entry entry;
+        entry.timelineValue = timelineValue;
+        entry.type = vk::ObjectType::eUnknown;
+        entry.allocation = allocation;
+        Insert(entry);
+        allocation = Allocation();
+    }
+
+    // 每帧调用一次，销毁GPU已经用完的对象，最多销毁budget个，不会阻塞，返回销毁了多少个
+    size_t Collect(size_t budget = DEFAULT_BUDGET) {
+        size_t count = 0;
+        while (count < budget && !entries.empty() && timeline->IsCompleted(entries.front().timelineValue)) {
+            DestroyEntry(entries.front());
+            entries.pop_front();
+            ++count;
+        }
+        destroyedCount += count;
+        return count;
+    }
+
+    size_t PendingCount() const { return entries.size(); }
+    uint64_t DestroyedCount() const { return destroyedCount; }
+
+private:
+    struct Entry final {
+        uint64_t timelineValue = 0;
+        vk::ObjectType type = vk::ObjectType::eUnknown; // eUnknown表示只有显存
+        uint64_t handle = 0;
+        Allocation allocation;
+    };
+
+    vk::Device device;
+    MemoryAllocator* allocator = nullptr;
+    GpuTimeline* timeline = nullptr;
+    std::deque<Entry> entries; // 按timeline值排好序
+    uint64_t destroyedCount = 0;
+
+    static constexpr bool IsSupported(vk::ObjectType type) {
+        switch (type) {
+            case vk::ObjectType::eBuffer:
+            case vk::ObjectType::eBufferView:
+            case vk::ObjectType::eImage:
+            case vk::ObjectType::eImageView:
+            case vk::ObjectType::eSampler:
+            case vk::ObjectType::eFramebuffer:
+            case vk::ObjectType::eRenderPass:
+            case vk::ObjectType::ePipeline:
+            case vk::ObjectType::ePipelineLayout:
+            case vk::ObjectType::eShaderModule:
+            case vk::ObjectType::eDescriptorPool:
+            case vk::ObjectType::eDescriptorSetLayout:
+            case vk::ObjectType::eCommandPool:
+            case vk::ObjectType::eQueryPool:
+            case vk::ObjectType::eSemaphore:
+            case vk::ObjectType::eFence:
+            case vk::ObjectType::eEvent:
+            case vk::ObjectType::eDeviceMemory:
+            case vk::ObjectType::eSwapchainKHR:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // 64位平台上non-dispatchable handle是指针，32位平台上是uint64_t
+    template<typename CType>
+    static uint64_t ToRaw(CType handle) {
+        if constexpr (std::is_pointer_v<CType>) {
+            return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(handle));
+        } else {
+            return static_cast<uint64_t>(handle);
+        }
+    }
+
+    template<typename Handle>
+    static Handle FromRaw(uint64_t raw) {
+        using CType = typename Handle::CType;
+        if constexpr (std::is_pointer_v<CType>) {
+            return Handle(reinterpret_cast<CType>(static_cast<uintptr_t>(raw)));
+        } else {
+            return Handle(static_cast<CType>(raw));
+        }
+    }
+
+    // 一般都是往后面追加，只有值比队尾小的时候才需要找位置插进去
+    void Insert(const Entry& entry) {
+        if (entries.empty() || entries.back().timelineValue <= entry.timelineValue) {
+            entries.push_back(entry);
+            return;
+        }
+        auto position = std::upper_bound(entries.begin(), entries.end(), entry.timelineValue,
+                                         [](uint64_t value, const Entry& other) { return value < other.timelineValue; });
+        entries.insert(position, entry);
+    }
+
+    void DestroyEntry(Entry& entry) {
+        switch (entry.type) {
+            case vk::ObjectType::eUnknown: break;
+            case vk::ObjectType::eBuffer: device.destroy(FromRaw<vk::Buffer>(entry.handle)); break;
+            case vk::ObjectType::eBufferView: device.destroy(FromRaw<vk::BufferView>(entry.handle)); break;
+            case vk::ObjectType::eImage: device.destroy(FromRaw<vk::Image>(entry.handle)); break;
+            case vk::ObjectType::eImageView: device.destroy(FromRaw<vk::ImageView>(entry.handle)); break;
+            case vk::ObjectType::eSampler: device.destroy(FromRaw<vk::Sampler>(entry.handle)); break;
+            case vk::ObjectType::eFramebuffer: device.destroy(FromRaw<vk::Framebuffer>(entry.handle)); break;
+            case vk::ObjectType::eRenderPass: device.destroy(FromRaw<vk::RenderPass>(entry.handle)); break;
+            case vk::ObjectType::ePipeline: device.destroy(FromRaw<vk::Pipeline>(entry.handle)); break;
+            case vk::ObjectType::ePipelineLayout: device.destroy(FromRaw<vk::PipelineLayout>(entry.handle)); break;
+            case vk::ObjectType::eShaderModule: device.destroy(FromRaw<vk::ShaderModule>(entry.handle)); break;
+            case vk::ObjectType::eDescriptorPool: device.destroy(FromRaw<vk::DescriptorPool>(entry.handle)); break;
+            case vk::ObjectType::eDescriptorSetLayout: device.destroy(FromRaw<vk::DescriptorSetLayout>(entry.handle)); break;
+            case vk::ObjectType::eCommandPool: device.destroy(FromRaw<vk::CommandPool>(entry.handle)); break;
+            case vk::ObjectType::eQueryPool: device.destroy(FromRaw<vk::QueryPool>(entry.handle)); break;
+            case vk::ObjectType::eSemaphore: device.destroy(FromRaw<vk::Semaphore>(entry.handle)); break;
+            case vk::ObjectType::eFence: device.destroy(FromRaw<vk::Fence>(entry.handle)); break;
+            case vk::ObjectType::eEvent: device.destroy(FromRaw<vk::Event>(entry.handle)); break;
+            case vk::ObjectType::eDeviceMemory: device.free(FromRaw<vk::DeviceMemory>(entry.handle)); break;
+            case vk::ObjectType::eSwapchainKHR: device.destroy(FromRaw<vk::SwapchainKHR>(entry.handle)); break;
+            default: throw std::runtime_error("DeletionQueue: unsupported object type " + vk::to_string(entry.type));
+        }
+        if (entry.allocation) allocator->Free(entry.allocation);
+    }
+};
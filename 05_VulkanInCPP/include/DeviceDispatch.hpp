@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstddef>
+
+// 每一帧都会调用的设备级函数
+// 需要新的vkCmd*的时候加到这个列表里面
+#define DEVICE_DISPATCH_FUNCTIONS(X) \
+    X(vkBeginCommandBuffer) \
+    X(vkEndCommandBuffer) \
+    X(vkResetCommandPool) \
+    X(vkCmdBeginRenderPass) \
+    X(vkCmdEndRenderPass) \
+    X(vkCmdBeginRendering) \
+    X(vkCmdEndRendering) \
+    X(vkCmdExecuteCommands) \
+    X(vkCmdBindPipeline) \
+    X(vkCmdSetViewport) \
+    X(vkCmdSetScissor) \
+    X(vkCmdBindVertexBuffers) \
+    X(vkCmdBindIndexBuffer) \
+    X(vkCmdDraw) \
+    X(vkCmdDrawIndexed) \
+    X(vkCmdPipelineBarrier) \
+    X(vkCmdCopyBuffer) \
+    X(vkCmdCopyImageToBuffer) \
+    X(vkQueueSubmit) \
+    X(vkAcquireNextImageKHR) \
+    X(vkQueuePresentKHR)
+
+// 设备级的函数表，可以直接作为vulkan.hpp的dispatcher传给每一个调用，比如commandBuffer.draw(3, 1, 0, 0, dispatch)
+// 默认的静态dispatcher调用的是loader导出的函数，loader再查一次设备的函数表跳到驱动里面(trampoline)
+// direct为true的时候用vkGetDeviceProcAddr直接拿驱动(或者最上面一层layer)的函数地址，每次调用少一次跳转
+// direct为false的时候表里面放的就是loader导出的函数，用来和direct对比
+struct DeviceDispatch final {
+#define DEVICE_DISPATCH_MEMBER(name) PFN_##name name = nullptr;
+    DEVICE_DISPATCH_FUNCTIONS(DEVICE_DISPATCH_MEMBER)
+#undef DEVICE_DISPATCH_MEMBER
+
+    // 没有打开对应扩展的函数(比如无窗口模式下的交换链函数、1.2的设备上的dynamic rendering)拿到的是空指针，不调用就没关系
+    void Init(vk::Device device, bool direct) {
+#define DEVICE_DISPATCH_LOAD(name) name = direct ? reinterpret_cast<PFN_##name>(device.getProcAddr(#name)) : &::name;
+        DEVICE_DISPATCH_FUNCTIONS(DEVICE_DISPATCH_LOAD)
+#undef DEVICE_DISPATCH_LOAD
+    }
+
+    // vulkan.hpp会检查dispatcher和头文件的版本是否一致
+    size_t getVkHeaderVersion() const { return VK_HEADER_VERSION; }
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+// 统计一组耗时(毫秒)的最小值、平均值、最大值和百分位数
+// window不为0的时候只保留最近window个样本，用来做滚动统计
+class FrameStats final {
+public:
+    explicit FrameStats(size_t window = 0) : window(window) {}
+
+    void Add(double ms) {
+        samples.push_back(ms);
+        if (window > 0 && samples.size() > window) samples.pop_front();
+    }
+
+    void Clear() { samples.clear(); }
+    size_t Count() const { return samples.size(); }
+
+    double Min() const { return samples.empty() ? 0.0 : *std::min_element(samples.begin(), samples.end()); }
+    double Max() const { return samples.empty() ? 0.0 : *std::max_element(samples.begin(), samples.end()); }
+    double Average() const {
+        return samples.empty() ? 0.0 : std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    }
+
+    // p在0到100之间，比如99就是p99
+    double Percentile(double p) const {
+        if (samples.empty()) return 0.0;
+        std::vector<double> sorted(samples.begin(), samples.end());
+        auto index = static_cast<size_t>(std::clamp(p / 100.0, 0.0, 1.0) * (sorted.size() - 1) + 0.5);
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+private:
+    size_t window;
+    std::deque<double> samples;
+};
+
+// 测量从采样输入到这一帧渲染完成的延迟
+// 专门开一个线程去等每一帧的timeline值，这样拿到的完成时间不受主线程帧率的影响
+// 没有用VK_KHR_present_wait，所以测到的是GPU渲染完成的时间，不包含合成器和显示器扫描的时间
+class LatencyProbe final {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void Start(vk::Device device, vk::Semaphore timeline) {
+        this->device = device;
+        this->timeline = timeline;
+        stopping = false;
+        worker = std::thread([this] { WorkerLoop(); });
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    // 提交完一帧之后调用，inputTime是这一帧采样输入的时间
+    void Track(uint64_t timelineValue, Clock::time_point inputTime) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back({ timelineValue, inputTime });
+        }
+        condition.notify_one();
+    }
+
+    // 取走目前为止测到的所有延迟
+    FrameStats Collect() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto result = latencies;
+        latencies.Clear();
+        return result;
+    }
+
+    // 等所有已经Track的帧都测完
+    void Flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait(lock, [this] { return pending.empty() && !busy; });
+    }
+
+private:
+    struct Pending final {
+        uint64_t timelineValue;
+        Clock::time_point inputTime;
+    };
+
+    vk::Device device;
+    vk::Semaphore timeline;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::condition_variable drained;
+    std::deque<Pending> pending;
+    FrameStats latencies;
+    bool stopping = false;
+    bool busy = false;
+
+    void WorkerLoop() {
+        while (true) {
+            Pending item;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (pending.empty()) return;
+                item = pending.front();
+                pending.pop_front();
+                busy = true;
+            }
+            auto waitInfo = vk::SemaphoreWaitInfo();
+            waitInfo.setSemaphores(timeline)
+                    .setValues(item.timelineValue);
+            auto result = device.waitSemaphores(waitInfo, UINT64_MAX);
+            auto doneTime = Clock::now();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (result == vk::Result::eSuccess) {
+                    latencies.Add(std::chrono::duration<double, std::milli>(doneTime - item.inputTime).count());
+                }
+                busy = false;
+            }
+            drained.notify_all();
+        }
+    }
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "FrameStats.hpp"
+#include "Tracer.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// 用timestamp query测量GPU上每一段命令的耗时
+// 每一帧在飞的资源都有自己的query pool，轮到这一套资源的时候上一次的结果肯定已经执行完了(DrawPerFrame会先等timeline)，
+// 所以读结果不会阻塞，也不会和GPU抢同一个query
+// Scope的名字必须是字符串常量，每一帧只记录指针，不复制字符串
+// Tracer开启的时候每一段还会按CPU的时钟记录到时间线上，有VK_EXT_calibrated_timestamps的时候用它对齐两个时钟，
+// 没有的话就把每一帧第一个时间戳对齐到这一帧开始录制的CPU时间，只能看个大概
+class GpuProfiler final {
+public:
+    static constexpr uint32_t MAX_SCOPES = 64; // 每一帧最多记录这么多段
+
+    struct ScopeStats final {
+        std::string name;
+        double min = 0.0;
+        double average = 0.0;
+        double max = 0.0;
+        double p99 = 0.0;
+        size_t count = 0;
+    };
+
+    // 不支持timestamp的队列(timestampValidBits为0)直接关闭profiler，之后所有的调用都什么也不做
+    // calibratedTimestamps表示创建逻辑设备的时候打开了VK_EXT_calibrated_timestamps
+    void Init(vk::Instance instance, vk::PhysicalDevice physicalDevice, vk::Device device, uint32_t queueFamilyIndex, bool calibratedTimestamps, size_t window = 256) {
+        this->device = device;
+        this->window = window;
+        auto validBits = physicalDevice.getQueueFamilyProperties()[queueFamilyIndex].timestampValidBits;
+        enabled = validBits > 0;
+        validMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+        timestampPeriod = physicalDevice.getProperties().limits.timestampPeriod;
+        if (enabled && calibratedTimestamps) InitCalibration(instance, physicalDevice);
+    }
+
+    void Destroy() {
+        for (auto& frame : frames) {
+            device.destroyQueryPool(frame.pool);
+        }
+        frames.clear();
+    }
+
+    bool Enabled() const { return enabled; }
+
+    // command buffer begin之后、进入render pass之前调用
+    // 先把这一套资源上一次记录的结果读出来，然后reset整个query pool给这一帧用
+    void BeginFrame(vk::CommandBuffer commandBuffer, uint32_t frameIndex) {
+        if (!enabled) return;
+        while (frames.size() <= frameIndex) {
+            auto createInfo = vk::QueryPoolCreateInfo();
+            createInfo.setQueryType(vk::QueryType::eTimestamp)
+                      .setQueryCount(MAX_SCOPES * 2);
+            frames.push_back({ device.createQueryPool(createInfo) });
+        }
+        current = &frames[frameIndex];
+        Collect(*current);
+        commandBuffer.resetQueryPool(current->pool, 0, MAX_SCOPES * 2);
+        current->cpuBeginNs = Tracer::NowNs();
+        // 两个时钟会慢慢漂移，隔一段时间重新对齐一次
+        if (Tracer::Enabled() && getCalibratedTimestamps && frameCounter++ % CALIBRATION_INTERVAL == 0) Calibrate();
+    }
+
+    // 返回的编号传给EndScope，render pass里面用secondary command buffer的时候不能写timestamp，要放在render pass外面
+    uint32_t BeginScope(vk::CommandBuffer commandBuffer, const char* name) {
+        if (!enabled || !current || current->names.size() == MAX_SCOPES) return MAX_SCOPES;
+        auto scope = static_cast<uint32_t>(current->names.size());
+        current->names.push_back(name);
+        commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, current->pool, scope * 2);
+        return scope;
+    }
+
+    void EndScope(vk::CommandBuffer commandBuffer, uint32_t scope) {
+        if (scope == MAX_SCOPES) return;
+        commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, current->pool, scope * 2 + 1);
+    }
+
+    // 每一个名字最近window帧的统计，单位是毫秒
+    std::vector<ScopeStats> GetStats() const {
+        std::vector<ScopeStats> result;
+        for (const auto& [name, samples] : scopes) {
+            result.push_back({ name, samples.Min(), samples.Average(), samples.Max(), samples.Percentile(99), samples.Count() });
+        }
+        return result;
+    }
+
+    void Dump(std::ostream& out) const {
+        if (!enabled) return;
+        out << "GPU timings (last " << window << " frames, ms):" << std::endl;
+        out << std::fixed << std::setprecision(3);
+        for (const auto& stats : GetStats()) {
+            out << "  " << std::left << std::setw(16) << stats.name << std::right
+                << " min " << stats.min << " avg " << stats.average
+                << " max " << stats.max << " p99 " << stats.p99 << std::endl;
+        }
+        out << std::defaultfloat;
+    }
+
+private:
+    struct Frame final {
+        vk::QueryPool pool;
+        std::vector<const char*> names; // 第i段的开始和结束分别是第2i和2i+1个query
+        int64_t cpuBeginNs = 0; // 没有校准的时候用来对齐时间线
+    };
+
+    static constexpr uint32_t CALIBRATION_INTERVAL = 120;
+
+    vk::Device device;
+    bool enabled = false;
+    uint64_t validMask = ~0ull;
+    float timestampPeriod = 1.0f; // 每一个tick是多少纳秒
+    size_t window = 256;
+    std::vector<Frame> frames;
+    Frame* current = nullptr;
+    std::map<std::string, FrameStats, std::less<>> scopes;
+    PFN_vkGetCalibratedTimestampsEXT getCalibratedTimestamps = nullptr;
+    VkTimeDomainEXT hostDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+    bool calibrated = false;
+    uint64_t calibrationTick = 0; // 同一时刻GPU的时间戳和CPU的纳秒
+    int64_t calibrationNs = 0;
+    uint64_t frameCounter = 0;
+
+    // steady_clock在Windows上是QueryPerformanceCounter，在Linux上是CLOCK_MONOTONIC，要找和它一样的时钟域
+    static bool HostTimeDomain(VkTimeDomainEXT& domain) {
+#if defined(_WIN32)
+        domain = VK_TIME_DOMAIN_QUERY_PERFORMANCE_COUNTER_EXT;
+        return true;
+#elif defined(__linux__)
+        domain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void InitCalibration(vk::Instance instance, vk::PhysicalDevice physicalDevice) {
+        VkTimeDomainEXT wantedDomain;
+        if (!HostTimeDomain(wantedDomain)) return;
+        auto getDomains = reinterpret_cast<PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT>(instance.getProcAddr("vkGetPhysicalDeviceCalibrateableTimeDomainsEXT"));
+        auto getTimestamps = reinterpret_cast<PFN_vkGetCalibratedTimestampsEXT>(device.getProcAddr("vkGetCalibratedTimestampsEXT"));
+        if (!getDomains || !getTimestamps) return;
+        uint32_t count = 0;
+        getDomains(physicalDevice, &count, nullptr);
+        std::vector<VkTimeDomainEXT> domains(count);
+        getDomains(physicalDevice, &count, domains.data());
+        bool hasDevice = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_EXT) != domains.end();
+        bool hasHost = std::find(domains.begin(), domains.end(), wantedDomain) != domains.end();
+        if (!hasDevice || !hasHost) return;
+        hostDomain = wantedDomain;
+        getCalibratedTimestamps = getTimestamps;
+    }
+
+    void Calibrate() {
+        VkCalibratedTimestampInfoEXT infos[2] = {};
+        infos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+        infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+        infos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+        infos[1].timeDomain = hostDomain;
+        uint64_t timestamps[2] = {};
+        uint64_t maxDeviation = 0;
+        if (getCalibratedTimestamps(device, 2, infos, timestamps, &maxDeviation) != VK_SUCCESS) return;
+        calibrationTick = timestamps[0] & validMask;
+        calibrationNs = HostTicksToNs(timestamps[1]);
+        calibrated = true;
+    }
+
+    static int64_t HostTicksToNs(uint64_t ticks) {
+#ifdef _WIN32
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return static_cast<int64_t>(static_cast<double>(ticks) * 1e9 / static_cast<double>(frequency.QuadPart));
+#else
+        return static_cast<int64_t>(ticks); // CLOCK_MONOTONIC本来就是纳秒
+#endif
+    }
+
+    // 把GPU的时间戳换算成steady_clock的纳秒，anchorTick/anchorNs是同一时刻两个时钟的值
+    int64_t TickToNs(uint64_t tick, uint64_t anchorTick, int64_t anchorNs) const {
+        auto delta = static_cast<int64_t>(tick) - static_cast<int64_t>(anchorTick);
+        return anchorNs + static_cast<int64_t>(delta * static_cast<double>(timestampPeriod));
+    }
+
+    void Collect(Frame& frame) {
+        if (frame.names.empty()) return;
+        auto queryCount = static_cast<uint32_t>(frame.names.size() * 2);
+        // 不带eWait，结果还没出来的时候返回eNotReady，这一帧的数据就不要了
+        auto results = device.getQueryPoolResults<uint64_t>(frame.pool, 0, queryCount, queryCount * sizeof(uint64_t), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+        if (results.result == vk::Result::eSuccess) {
+            for (size_t i = 0; i < frame.names.size(); ++i) {
+                auto ticks = ((results.value[i * 2 + 1] & validMask) - (results.value[i * 2] & validMask)) & validMask;
+                auto ms = ticks * static_cast<double>(timestampPeriod) / 1e6;
+                auto it = scopes.find(frame.names[i]);
+                if (it == scopes.end()) it = scopes.emplace(frame.names[i], FrameStats(window)).first;
+                it->second.Add(ms);
+            }
+            if (Tracer::Enabled()) {
+                auto anchorTick = calibrated ? calibrationTick : results.value[0] & validMask;
+                auto anchorNs = calibrated ? calibrationNs : frame.cpuBeginNs;
+                for (size_t i = 0; i < frame.names.size(); ++i) {
+                    Tracer::RecordGpu(frame.names[i], TickToNs(results.value[i * 2] & validMask, anchorTick, anchorNs),
+                                      TickToNs(results.value[i * 2 + 1] & validMask, anchorTick, anchorNs));
+                }
+            }
+        }
+        frame.names.clear();
+    }
+};
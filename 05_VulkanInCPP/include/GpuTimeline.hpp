@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+// 基于timeline semaphore的GPU进度，GPU的进度就是一个单调递增的值
+// 每次提交的时候signal一个新的值，上传、回读、延迟销毁这些子系统只要记住自己关心的值，
+// 之后查询或者等待这个值就行，不用每个子系统都自己创建一堆fence
+// timeline semaphore是Vulkan 1.2的核心功能，创建逻辑设备的时候需要打开timelineSemaphore特性
+class GpuTimeline final {
+public:
+    void Init(vk::Device device) {
+        this->device = device;
+        auto typeInfo = vk::SemaphoreTypeCreateInfo();
+        typeInfo.setSemaphoreType(vk::SemaphoreType::eTimeline)
+                .setInitialValue(0);
+        auto createInfo = vk::SemaphoreCreateInfo();
+        createInfo.setPNext(&typeInfo);
+        semaphore = device.createSemaphore(createInfo);
+        lastSignaled = 0;
+        lastCompleted = 0;
+    }
+
+    void Destroy() {
+        device.destroySemaphore(semaphore);
+        semaphore = nullptr;
+    }
+
+    // 下一次提交要signal的值，调用之后必须真的提交出去，不然后面等待这个值会一直等下去
+    uint64_t NextValue() {
+        return ++lastSignaled;
+    }
+
+    uint64_t LastSignaled() const { return lastSignaled; }
+
+    // 查询GPU已经执行到哪个值了，不会阻塞
+    uint64_t CompletedValue() {
+        lastCompleted = device.getSemaphoreCounterValue(semaphore);
+        return lastCompleted;
+    }
+
+    bool IsCompleted(uint64_t value) {
+        // 先用缓存的值判断，避免每次都去问驱动
+        return value <= lastCompleted || value <= CompletedValue();
+    }
+
+    void Wait(uint64_t value) {
+        if (IsCompleted(value)) return;
+        auto waitInfo = vk::SemaphoreWaitInfo();
+        waitInfo.setSemaphores(semaphore)
+                .setValues(value);
+        auto result = device.waitSemaphores(waitInfo, UINT64_MAX);
+        if (result != vk::Result::eSuccess) {
+            throw std::runtime_error("failed to wait for timeline semaphore!");
+        }
+        lastCompleted = std::max(lastCompleted, value);
+    }
+
+    vk::Semaphore Get() const { return semaphore; }
+
+private:
+    vk::Device device;
+    vk::Semaphore semaphore;
+    uint64_t lastSignaled = 0;
+    uint64_t lastCompleted = 0;
+};
@@ -0,0 +1,499 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// 一个VkDeviceMemory里面放很多个buffer/image，避免每个buffer都调用一次vkAllocateMemory
+// 驱动对allocateMemory的次数是有上限的(maxMemoryAllocationCount，很多显卡只有4096)，而且每次分配都很慢
+
+// 资源的类型，线性资源(buffer、linear image)和非线性资源(optimal image)挨在一起的时候要满足bufferImageGranularity
+enum class ResourceKind : uint8_t {
+    eFree = 0,
+    eLinear,
+    eOptimal,
+};
+
+// TLSF(Two-Level Segregated Fit)子分配器，只管理偏移和大小，不涉及任何Vulkan对象
+// 第一级按2的幂分桶，第二级把每个2的幂区间再均分成32份，查找和释放都是O(1)
+class TlsfBlock final {
+public:
+    struct Chunk final {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        ResourceKind kind = ResourceKind::eFree;
+        Chunk* prevPhysical = nullptr; // 地址上相邻的前一块，用来合并空闲块
+        Chunk* nextPhysical = nullptr;
+        Chunk* prevFree = nullptr; // 同一个桶里面的空闲链表
+        Chunk* nextFree = nullptr;
+    };
+
+    explicit TlsfBlock(uint64_t size, uint64_t granularity = 1) : size(size), granularity(granularity) {
+        auto chunk = new Chunk();
+        chunk->size = size;
+        InsertFree(chunk);
+    }
+
+    TlsfBlock(const TlsfBlock&) = delete;
+    TlsfBlock& operator=(const TlsfBlock&) = delete;
+
+    ~TlsfBlock() {
+        // 找到地址最小的块，然后顺着物理链表全部释放
+        auto chunk = anyChunk;
+        while (chunk && chunk->prevPhysical) chunk = chunk->prevPhysical;
+        while (chunk) {
+            auto next = chunk->nextPhysical;
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    // 成功返回分配出来的块，失败返回nullptr
+    Chunk* Allocate(uint64_t allocSize, uint64_t alignment, ResourceKind kind) {
+        if (allocSize == 0) allocSize = 1;
+        if (alignment == 0) alignment = 1;
+        // 查找的时候按最坏情况来算，保证找到的空闲块一定放得下对齐和granularity的填充
+        uint64_t searchSize = allocSize + alignment - 1;
+        if (granularity > 1) searchSize += granularity * 2;
+        if (allocSize > size) return nullptr;
+
+        auto chunk = FindSuitable(searchSize);
+        if (!chunk) {
+            // 最坏情况下放不下的时候，还有可能存在刚好够用的块，退化成线性查找
+            chunk = FindFirstFit(allocSize, alignment, kind);
+            if (!chunk) return nullptr;
+        }
+        uint64_t offset = 0;
+        if (!Fits(chunk, allocSize, alignment, kind, offset)) {
+            chunk = FindFirstFit(allocSize, alignment, kind);
+            if (!chunk || !Fits(chunk, allocSize, alignment, kind, offset)) return nullptr;
+        }
+        RemoveFree(chunk);
+
+        // 前面因为对齐空出来的部分重新作为空闲块
+        if (offset > chunk->offset) {
+            auto padding = new Chunk();
+            padding->offset = chunk->offset;
+            padding->size = offset - chunk->offset;
+            padding->prevPhysical = chunk->prevPhysical;
+            padding->nextPhysical = chunk;
+            if (chunk->prevPhysical) chunk->prevPhysical->nextPhysical = padding;
+            chunk->prevPhysical = padding;
+            chunk->offset = offset;
+            chunk->size -= padding->size;
+            InsertFree(padding);
+        }
+        uint64_t end = offset + allocSize;
+        if (granularity > 1 && NextConflicts(chunk, kind)) {
+            end = AlignUp(end, granularity);
+        }
+        // 后面剩下的部分也作为空闲块
+        if (chunk->offset + chunk->size > end) {
+            auto remain = new Chunk();
+            remain->offset = end;
+            remain->size = chunk->offset + chunk->size - end;
+            remain->prevPhysical = chunk;
+            remain->nextPhysical = chunk->nextPhysical;
+            if (chunk->nextPhysical) chunk->nextPhysical->prevPhysical = remain;
+            chunk->nextPhysical = remain;
+            chunk->size = end - chunk->offset;
+            InsertFree(remain);
+        }
+        chunk->kind = kind;
+        usedBytes += chunk->size;
+        ++allocationCount;
+        anyChunk = chunk;
+        return chunk;
+    }
+
+    void Free(Chunk* chunk) {
+        usedBytes -= chunk->size;
+        --allocationCount;
+        chunk->kind = ResourceKind::eFree;
+        // 和前后相邻的空闲块合并，避免碎片
+        if (chunk->prevPhysical && chunk->prevPhysical->kind == ResourceKind::eFree) {
+            auto prev = chunk->prevPhysical;
+            RemoveFree(prev);
+            prev->size += chunk->size;
+            prev->nextPhysical = chunk->nextPhysical;
+            if (chunk->nextPhysical) chunk->nextPhysical->prevPhysical = prev;
+            delete chunk;
+            chunk = prev;
+        }
+        if (chunk->nextPhysical && chunk->nextPhysical->kind == ResourceKind::eFree) {
+            auto next = chunk->nextPhysical;
+            RemoveFree(next);
+            chunk->size += next->size;
+            chunk->nextPhysical = next->nextPhysical;
+            if (next->nextPhysical) next->nextPhysical->prevPhysical = chunk;
+            delete next;
+        }
+        anyChunk = chunk;
+        InsertFree(chunk);
+    }
+
+    bool Empty() const { return allocationCount == 0; }
+    uint64_t Size() const { return size; }
+    uint64_t UsedBytes() const { return usedBytes; }
+    uint32_t AllocationCount() const { return allocationCount; }
+
+private:
+    static constexpr uint32_t SL_LOG2 = 5;
+    static constexpr uint32_t SL_COUNT = 1u << SL_LOG2;
+    static constexpr uint32_t MIN_LOG2 = 8; // 小于256字节的都放到第0级，按8字节线性分桶
+    static constexpr uint32_t FL_COUNT = 64 - MIN_LOG2 + 1;
+
+    uint64_t size;
+    uint64_t granularity;
+    uint64_t usedBytes = 0;
+    uint32_t allocationCount = 0;
+    uint64_t flBitmap = 0;
+    std::array<uint32_t, FL_COUNT> slBitmap{};
+    std::array<std::array<Chunk*, SL_COUNT>, FL_COUNT> heads{};
+    Chunk* anyChunk = nullptr; // 任意一个存活的块，析构的时候用来找到物理链表
+
+    static uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    static void Mapping(uint64_t value, uint32_t& fl, uint32_t& sl) {
+        if (value < (1ull << MIN_LOG2)) {
+            fl = 0;
+            sl = static_cast<uint32_t>(value >> (MIN_LOG2 - SL_LOG2));
+        } else {
+            uint32_t log2 = std::bit_width(value) - 1;
+            sl = static_cast<uint32_t>(value >> (log2 - SL_LOG2)) ^ SL_COUNT;
+            fl = log2 - MIN_LOG2 + 1;
+        }
+    }
+
+    void InsertFree(Chunk* chunk) {
+        uint32_t fl, sl;
+        Mapping(chunk->size, fl, sl);
+        chunk->kind = ResourceKind::eFree;
+        chunk->prevFree = nullptr;
+        chunk->nextFree = heads[fl][sl];
+        if (heads[fl][sl]) heads[fl][sl]->prevFree = chunk;
+        heads[fl][sl] = chunk;
+        flBitmap |= 1ull << fl;
+        slBitmap[fl] |= 1u << sl;
+        anyChunk = chunk;
+    }
+
+    void RemoveFree(Chunk* chunk) {
+        uint32_t fl, sl;
+        Mapping(chunk->size, fl, sl);
+        if (chunk->prevFree) chunk->prevFree->nextFree = chunk->nextFree;
+        if (chunk->nextFree) chunk->nextFree->prevFree = chunk->prevFree;
+        if (heads[fl][sl] == chunk) {
+            heads[fl][sl] = chunk->nextFree;
+            if (!heads[fl][sl]) {
+                slBitmap[fl] &= ~(1u << sl);
+                if (!slBitmap[fl]) flBitmap &= ~(1ull << fl);
+            }
+        }
+        chunk->prevFree = chunk->nextFree = nullptr;
+    }
+
+    Chunk* FindSuitable(uint64_t searchSize) {
+        // 向上取整到下一个桶，这样桶里面的任何一个块都一定够大
+        if (searchSize >= (1ull << MIN_LOG2)) {
+            searchSize += (1ull << (std::bit_width(searchSize) - 1 - SL_LOG2)) - 1;
+        } else {
+            searchSize += (1ull << (MIN_LOG2 - SL_LOG2)) - 1;
+        }
+        uint32_t fl, sl;
+        Mapping(searchSize, fl, sl);
+        if (fl >= FL_COUNT) return nullptr;
+        uint32_t slMap = sl < SL_COUNT ? slBitmap[fl] & (~0u << sl) : 0;
+        if (!slMap) {
+            uint64_t flMap = fl + 1 < 64 ? flBitmap & (~0ull << (fl + 1)) : 0;
+            if (!flMap) return nullptr;
+            fl = std::countr_zero(flMap);
+            slMap = slBitmap[fl];
+        }
+        sl = std::countr_zero(slMap);
+        return heads[fl][sl];
+    }
+
+    Chunk* FindFirstFit(uint64_t allocSize, uint64_t alignment, ResourceKind kind) {
+        uint64_t offset;
+        for (auto& row : heads) {
+            for (auto head : row) {
+                for (auto chunk = head; chunk; chunk = chunk->nextFree) {
+                    if (Fits(chunk, allocSize, alignment, kind, offset)) return chunk;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // 空闲块会和相邻的空闲块合并，所以空闲块的前后邻居一定是已经分配出去的块
+    bool PrevConflicts(const Chunk* chunk, uint64_t offset, ResourceKind kind) const {
+        auto prev = chunk->prevPhysical;
+        if (!prev || prev->kind == kind) return false;
+        return (prev->offset + prev->size - 1) / granularity == offset / granularity;
+    }
+
+    bool NextConflicts(const Chunk* chunk, ResourceKind kind) const {
+        auto next = chunk->nextPhysical;
+        return next && next->kind != ResourceKind::eFree && next->kind != kind;
+    }
+
+    bool Fits(const Chunk* chunk, uint64_t allocSize, uint64_t alignment, ResourceKind kind, uint64_t& offset) const {
+        offset = AlignUp(chunk->offset, alignment);
+        if (granularity > 1 && PrevConflicts(chunk, offset, kind)) {
+            offset = AlignUp(offset, std::max(alignment, granularity));
+        }
+        uint64_t end = offset + allocSize;
+        if (granularity > 1 && NextConflicts(chunk, kind)) {
+            end = AlignUp(end, granularity);
+        }
+        return end <= chunk->offset + chunk->size;
+    }
+};
+
+// 从大块显存中子分配出来的一段内存
+struct Allocation final {
+    vk::DeviceMemory memory;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    void* mapped = nullptr; // host visible的内存会一直保持映射，这里直接是偏移之后的地址
+    uint32_t memoryTypeIndex = 0;
+    void* block = nullptr; // 内部使用
+    TlsfBlock::Chunk* chunk = nullptr;
+    explicit operator bool() const { return static_cast<bool>(memory); }
+};
+
+struct AllocatedBuffer final {
+    vk::Buffer buffer;
+    Allocation allocation;
+};
+
+struct AllocatedImage final {
+    vk::Image image;
+    Allocation allocation;
+};
+
+class MemoryAllocator final {
+public:
+    struct Stats final {
+        uint32_t deviceMemoryCount = 0; // 当前存活的vkAllocateMemory数量
+        uint64_t totalAllocateCalls = 0; // 累计调用了多少次vkAllocateMemory
+        uint64_t reservedBytes = 0; // 从驱动那里拿到的显存总量
+        uint64_t usedBytes = 0; // 子分配出去的显存总量
+        uint32_t allocationCount = 0; // 子分配的数量
+    };
+
+    static constexpr vk::DeviceSize DEFAULT_BLOCK_SIZE = 64ull * 1024 * 1024;
+
+    void Init(vk::PhysicalDevice physicalDevice, vk::Device device) {
+        this->device = device;
+        memoryProperties = physicalDevice.getMemoryProperties();
+        auto limits = physicalDevice.getProperties().limits;
+        granularity = limits.bufferImageGranularity;
+        nonCoherentAtomSize = limits.nonCoherentAtomSize;
+        for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+            // 小的堆(比如只有256MB的BAR)不能一次拿64MB，按堆大小的1/8来分块
+            auto heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[i].heapIndex].size;
+            blockSizes[i] = std::min(DEFAULT_BLOCK_SIZE, std::bit_floor(heapSize / 8));
+        }
+    }
+
+    void Destroy() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& pool : pools) {
+            for (auto& block : pool) {
+                if (!block->tlsf.Empty()) {
+                    std::cerr << "MemoryAllocator: " << block->tlsf.AllocationCount() << " allocations leaked" << std::endl;
+                }
+                FreeBlock(*block);
+            }
+            pool.clear();
+        }
+    }
+
+    uint32_t FindMemoryType(uint32_t typeBits, vk::MemoryPropertyFlags required, vk::MemoryPropertyFlags preferred = {}) const {
+        // 先找同时满足required和preferred的，找不到再退回只满足required的
+        for (auto flags : { required | preferred, required }) {
+            for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+                if ((typeBits & (1u << i)) && (memoryProperties.memoryTypes[i].propertyFlags & flags) == flags) {
+                    return i;
+                }
+            }
+        }
+        throw std::runtime_error("failed to find suitable memory type!");
+    }
+
+    Allocation Allocate(const vk::MemoryRequirements& requirements, vk::MemoryPropertyFlags required, vk::MemoryPropertyFlags preferred, ResourceKind kind) {
+        auto typeIndex = FindMemoryType(requirements.memoryTypeBits, required, preferred);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& pool = pools[typeIndex];
+
+        // 超过块大小一半的资源单独分配，不然会浪费很多空间
+        if (requirements.size > blockSizes[typeIndex] / 2) {
+            auto& block = CreateBlock(typeIndex, requirements.size, true);
+            return AllocateFrom(block, requirements, kind);
+        }
+        for (auto& block : pool) {
+            if (block->dedicated) continue;
+            if (auto allocation = AllocateFrom(*block, requirements, kind)) {
+                return allocation;
+            }
+        }
+        auto& block = CreateBlock(typeIndex, blockSizes[typeIndex], false);
+        auto allocation = AllocateFrom(block, requirements, kind);
+        if (!allocation) {
+            throw std::runtime_error("failed to sub-allocate device memory!");
+        }
+        return allocation;
+    }
+
+    void Free(Allocation& allocation) {
+        if (!allocation) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto block = static_cast<Block*>(allocation.block);
+        block->tlsf.Free(allocation.chunk);
+        allocation = Allocation();
+        if (!block->tlsf.Empty()) return;
+        // 空的块只保留一个，防止反复创建销毁
+        auto& pool = pools[block->memoryTypeIndex];
+        bool keep = !block->dedicated && std::count_if(pool.begin(), pool.end(), [](const auto& b) {
+            return !b->dedicated && b->tlsf.Empty();
+        }) == 1;
+        if (keep) return;
+        FreeBlock(*block);
+        std::erase_if(pool, [block](const auto& b) { return b.get() == block; });
+    }
+
+    AllocatedBuffer CreateBuffer(const vk::BufferCreateInfo& createInfo, vk::MemoryPropertyFlags required, vk::MemoryPropertyFlags preferred = {}) {
+        AllocatedBuffer result;
+        result.buffer = device.createBuffer(createInfo);
+        auto requirements = device.getBufferMemoryRequirements(result.buffer);
+        result.allocation = Allocate(requirements, required, preferred, ResourceKind::eLinear);
+        device.bindBufferMemory(result.buffer, result.allocation.memory, result.allocation.offset);
+        return result;
+    }
+
+    void DestroyBuffer(AllocatedBuffer& buffer) {
+        if (buffer.buffer) device.destroyBuffer(buffer.buffer);
+        Free(buffer.allocation);
+        buffer.buffer = nullptr;
+    }
+
+    AllocatedImage CreateImage(const vk::ImageCreateInfo& createInfo, vk::MemoryPropertyFlags required, vk::MemoryPropertyFlags preferred = {}) {
+        AllocatedImage result;
+        result.image = device.createImage(createInfo);
+        auto requirements = device.getImageMemoryRequirements(result.image);
+        auto kind = createInfo.tiling == vk::ImageTiling::eLinear ? ResourceKind::eLinear : ResourceKind::eOptimal;
+        result.allocation = Allocate(requirements, required, preferred, kind);
+        device.bindImageMemory(result.image, result.allocation.memory, result.allocation.offset);
+        return result;
+    }
+
+    void DestroyImage(AllocatedImage& image) {
+        if (image.image) device.destroyImage(image.image);
+        Free(image.allocation);
+        image.image = nullptr;
+    }
+
+    // 非HOST_COHERENT的内存在CPU读GPU写入的数据之前要invalidate，coherent的内存什么也不做
+    // 范围要按nonCoherentAtomSize对齐，对齐之后不能超出整个VkDeviceMemory
+    void Invalidate(const Allocation& allocation, vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE) {
+        if (memoryProperties.memoryTypes[allocation.memoryTypeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent) return;
+        auto block = static_cast<Block*>(allocation.block);
+        if (size == VK_WHOLE_SIZE) size = allocation.size - offset;
+        auto begin = (allocation.offset + offset) / nonCoherentAtomSize * nonCoherentAtomSize;
+        auto end = std::min((allocation.offset + offset + size + nonCoherentAtomSize - 1) / nonCoherentAtomSize * nonCoherentAtomSize, block->tlsf.Size());
+        auto range = vk::MappedMemoryRange();
+        range.setMemory(allocation.memory)
+             .setOffset(begin)
+             .setSize(end - begin);
+        device.invalidateMappedMemoryRanges(range);
+    }
+
+    Stats GetStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats stats;
+        stats.totalAllocateCalls = totalAllocateCalls;
+        for (auto& pool : pools) {
+            for (auto& block : pool) {
+                ++stats.deviceMemoryCount;
+                stats.reservedBytes += block->tlsf.Size();
+                stats.usedBytes += block->tlsf.UsedBytes();
+                stats.allocationCount += block->tlsf.AllocationCount();
+            }
+        }
+        return stats;
+    }
+
+    void PrintStats() {
+        auto stats = GetStats();
+        std::cout << "Device memory: " << stats.deviceMemoryCount << " blocks (" << stats.totalAllocateCalls << " vkAllocateMemory calls), "
+                  << stats.allocationCount << " allocations, "
+                  << stats.usedBytes / 1024 << " KB used / " << stats.reservedBytes / 1024 << " KB reserved" << std::endl;
+    }
+
+private:
+    struct Block final {
+        vk::DeviceMemory memory;
+        uint32_t memoryTypeIndex;
+        bool dedicated;
+        void* mapped = nullptr;
+        TlsfBlock tlsf;
+        Block(vk::DeviceSize size, vk::DeviceSize granularity) : tlsf(size, granularity) {}
+    };
+
+    vk::Device device;
+    vk::PhysicalDeviceMemoryProperties memoryProperties;
+    vk::DeviceSize granularity = 1;
+    vk::DeviceSize nonCoherentAtomSize = 1;
+    std::array<vk::DeviceSize, VK_MAX_MEMORY_TYPES> blockSizes{};
+    std::array<std::vector<std::unique_ptr<Block>>, VK_MAX_MEMORY_TYPES> pools;
+    uint64_t totalAllocateCalls = 0;
+    std::mutex mutex;
+
+    Block& CreateBlock(uint32_t typeIndex, vk::DeviceSize size, bool dedicated) {
+        auto allocateInfo = vk::MemoryAllocateInfo();
+        allocateInfo.setAllocationSize(size)
+                    .setMemoryTypeIndex(typeIndex);
+        auto block = std::make_unique<Block>(size, granularity);
+        block->memory = device.allocateMemory(allocateInfo);
+        block->memoryTypeIndex = typeIndex;
+        block->dedicated = dedicated;
+        ++totalAllocateCalls;
+        // host visible的块整个映射一次，之后一直保持映射状态，不用每次map/unmap
+        if (memoryProperties.memoryTypes[typeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) {
+            block->mapped = device.mapMemory(block->memory, 0, VK_WHOLE_SIZE);
+        }
+        pools[typeIndex].push_back(std::move(block));
+        return *pools[typeIndex].back();
+    }
+
+    void FreeBlock(Block& block) {
+        if (block.mapped) device.unmapMemory(block.memory);
+        device.freeMemory(block.memory);
+    }
+
+    Allocation AllocateFrom(Block& block, const vk::MemoryRequirements& requirements, ResourceKind kind) {
+        auto chunk = block.tlsf.Allocate(requirements.size, requirements.alignment, kind);
+        if (!chunk) return Allocation();
+        Allocation allocation;
+        allocation.memory = block.memory;
+        allocation.offset = chunk->offset;
+        allocation.size = requirements.size;
+        allocation.mapped = block.mapped ? static_cast<char*>(block.mapped) + chunk->offset : nullptr;
+        allocation.memoryTypeIndex = block.memoryTypeIndex;
+        allocation.block = &block;
+        allocation.chunk = chunk;
+        return allocation;
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "MappedFile.hpp"
+
+// 二进制网格文件(.vmesh)，布局和GPU上的缓冲区完全一样，加载的时候不解析任何东西
+// | 头(MeshFileHeader) | 填充 | 顶点流 | 填充 | 索引流 |
+// - 顶点和索引都已经是渲染器用的格式(顶点的每个属性的格式和偏移记在头里面，索引是16位或者32位)，
+//   加载的时候mmap整个文件，两段数据直接从映射的内存拷贝到暂存缓冲区
+// - 每一段都从SECTION_ALIGNMENT对齐的偏移开始，和页对齐，以后也可以用VK_EXT_external_memory_host直接导入
+// - 文件用本机的字节序(小端)写，转换工具和渲染器跑在同一类机器上
+struct MeshFileHeader final {
+    static constexpr uint32_t MAGIC = 0x4853454D; // "MESH"
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t MAX_ATTRIBUTES = 8;
+
+    struct Attribute final {
+        uint32_t location = 0;
+        uint32_t format = 0; // VkFormat
+        uint32_t offset = 0;
+    };
+
+    uint32_t magic = MAGIC;
+    uint32_t version = VERSION;
+    uint32_t vertexStride = 0;
+    uint32_t vertexCount = 0;
+    uint32_t indexCount = 0;
+    uint32_t indexType = 0; // VkIndexType，VK_INDEX_TYPE_UINT16或者VK_INDEX_TYPE_UINT32
+    uint64_t vertexOffset = 0; // 相对文件开头
+    uint64_t vertexSize = 0;
+    uint64_t indexOffset = 0;
+    uint64_t indexSize = 0;
+    float boundsMin[3] = {}; // 顶点位置的包围盒，位置只有两个分量的时候z是0
+    float boundsMax[3] = {};
+    uint32_t attributeCount = 0;
+    Attribute attributes[MAX_ATTRIBUTES] = {};
+};
+
+class MeshFile final {
+public:
+    static constexpr uint64_t SECTION_ALIGNMENT = 4096;
+
+    MeshFile() = default;
+
+    // 映射文件并检查头，数据本身不读，真正用到的时候才会从磁盘加载
+    explicit MeshFile(const std::string& path) : file(path) {
+        if (file.Size() < sizeof(MeshFileHeader)) throw std::runtime_error("not a mesh file: " + path);
+        std::memcpy(&header, file.Data(), sizeof(MeshFileHeader));
+        if (header.magic != MeshFileHeader::MAGIC) throw std::runtime_error("not a mesh file: " + path);
+        if (header.version != MeshFileHeader::VERSION) throw std::runtime_error("unsupported mesh file version: " + path);
+        // 只认16位和32位的索引，其他的值(比如uint8)原样传给bindIndexBuffer会出错
+        size_t indexSize = 0;
+        if (header.indexType == static_cast<uint32_t>(vk::IndexType::eUint16)) indexSize = sizeof(uint16_t);
+        else if (header.indexType == static_cast<uint32_t>(vk::IndexType::eUint32)) indexSize = sizeof(uint32_t);
+        else throw std::runtime_error("unsupported index type in mesh file: " + path);
+        // 空的网格没法画，而且Vulkan不允许创建大小为0的buffer
+        if (header.vertexCount == 0 || header.indexCount == 0) throw std::runtime_error("empty mesh file: " + path);
+        // 偏移和大小都是从文件里读的，写成减法，offset + size溢出绕回来的时候也能检查出来
+        bool valid = header.attributeCount <= MeshFileHeader::MAX_ATTRIBUTES &&
+                     header.vertexSize == static_cast<uint64_t>(header.vertexStride) * header.vertexCount &&
+                     header.indexSize == static_cast<uint64_t>(indexSize) * header.indexCount &&
+                     InFile(header.vertexOffset, header.vertexSize) &&
+                     InFile(header.indexOffset, header.indexSize) &&
+                     header.indexCount % 3 == 0;
+        if (!valid) throw std::runtime_error("corrupted mesh file: " + path);
+    }
+
+    const MeshFileHeader& Header() const { return header; }
+    vk::IndexType IndexType() const { return static_cast<vk::IndexType>(header.indexType); }
+    const void* VertexData() const { return static_cast<const char*>(file.Data()) + header.vertexOffset; }
+    const void* IndexData() const { return static_cast<const char*>(file.Data()) + header.indexOffset; }
+
+    // 顶点的布局必须和管线的顶点输入一致，不一致的时候返回false
+    bool HasAttribute(uint32_t location, vk::Format format, uint32_t offset) const {
+        for (uint32_t i = 0; i < header.attributeCount; ++i) {
+            const auto& attribute = header.attributes[i];
+            if (attribute.location == location) {
+                return attribute.format == static_cast<uint32_t>(format) && attribute.offset == offset;
+            }
+        }
+        return false;
+    }
+
+    // 转换工具用，header里面的偏移和大小由这里填
+    static void Write(const std::string& path, MeshFileHeader header, const void* vertexData, const void* indexData) {
+        std::ofstream out(path, std::ios::binary);
+        if (!out.is_open()) throw std::runtime_error("failed to open " + path);
+        auto indexSize = header.indexType == static_cast<uint32_t>(vk::IndexType::eUint16) ? sizeof(uint16_t) : sizeof(uint32_t);
+        header.vertexSize = static_cast<uint64_t>(header.vertexStride) * header.vertexCount;
+        header.indexSize = static_cast<uint64_t>(indexSize) * header.indexCount;
+        header.vertexOffset = Align(sizeof(MeshFileHeader));
+        header.indexOffset = Align(header.vertexOffset + header.vertexSize);
+        std::vector<char> padding(SECTION_ALIGNMENT, 0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(padding.data(), static_cast<std::streamsize>(header.vertexOffset - sizeof(header)));
+        out.write(static_cast<const char*>(vertexData), static_cast<std::streamsize>(header.vertexSize));
+        out.write(padding.data(), static_cast<std::streamsize>(header.indexOffset - header.vertexOffset - header.vertexSize));
+        out.write(static_cast<const char*>(indexData), static_cast<std::streamsize>(header.indexSize));
+        if (!out) throw std::runtime_error("failed to write " + path);
+    }
+
+private:
+    MappedFile file;
+    MeshFileHeader header;
+
+    bool InFile(uint64_t offset, uint64_t size) const {
+        return size <= file.Size() && offset <= file.Size() - size;
+    }
+
+    static uint64_t Align(uint64_t offset) {
+        return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    }
+};
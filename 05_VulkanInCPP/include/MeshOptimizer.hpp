@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// 有索引的网格在加载的时候(或者离线)调整三角形和顶点的顺序
+// OptimizeVertexCache和OptimizeVertexFetch不改变画出来的结果；OptimizeOverdraw改变了三角形的先后，
+// 只有管线打开了深度测试的时候结果才不变(没有深度测试的时候重叠的三角形谁在上面由顺序决定)，也只有这时候才能减少overdraw
+// 1. OptimizeVertexCache：Tipsify，按顶点扇出三角形，让post-transform cache尽量命中，vertex shader少执行
+// 2. OptimizeOverdraw：把上一步的结果切成簇，朝外的簇先画，被挡住的片元早一点被深度测试剔除，簇内的顺序不变所以cache命中基本不受影响
+// 3. OptimizeVertexFetch：顶点按第一次被用到的顺序重排，读顶点缓冲区的时候基本是顺序访问
+// 顺序不能反，后面一步依赖前面一步的三角形顺序
+// AnalyzeVertexCache用FIFO cache模拟，得到ACMR(每个三角形平均变换几个顶点，最差3.0)和ATVR(变换次数和顶点数的比值，最好1.0)
+class MeshOptimizer final {
+public:
+    static constexpr uint32_t DEFAULT_CACHE_SIZE = 16;
+
+    struct VertexCacheStats final {
+        uint32_t transformedVertices = 0;
+        double acmr = 0.0;
+        double atvr = 0.0;
+    };
+
+    static VertexCacheStats AnalyzeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount, uint32_t cacheSize = DEFAULT_CACHE_SIZE) {
+        VertexCacheStats stats;
+        // 每个顶点记住它进cache的时间，当前时间减去它小于cacheSize就还在FIFO里面
+        std::vector<uint32_t> timestamps(vertexCount, 0);
+        std::vector<bool> used(vertexCount, false);
+        uint32_t time = cacheSize + 1;
+        size_t usedCount = 0;
+        for (auto index : indices) {
+            if (time - timestamps[index] > cacheSize) {
+                timestamps[index] = time++;
+                ++stats.transformedVertices;
+            }
+            if (!used[index]) {
+                used[index] = true;
+                ++usedCount;
+            }
+        }
+        if (indices.size() >= 3) stats.acmr = static_cast<double>(stats.transformedVertices) / (indices.size() / 3);
+        if (usedCount > 0) stats.atvr = static_cast<double>(stats.transformedVertices) / usedCount;
+        return stats;
+    }
+
+    // Tipsify(Sander, Nehab, Barczak 2007)：每次选一个扇出顶点，把它周围还没输出的三角形全部输出，
+    // 下一个扇出顶点在刚输出的顶点里面选，优先选还在cache里面、剩下的三角形又能在被挤出cache之前输出完的
+    // 找不到的时候(走进死胡同)跳到别的地方，这些位置记在clusterStarts里面，是切簇的硬边界
+    static std::vector<uint32_t> OptimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount,
+                                                     uint32_t cacheSize = DEFAULT_CACHE_SIZE, std::vector<uint32_t>* clusterStarts = nullptr) {
+        auto triangleCount = indices.size() / 3;
+        std::vector<uint32_t> result;
+        result.reserve(triangleCount * 3);
+        if (clusterStarts) clusterStarts->clear();
+        if (triangleCount == 0) return result;
+
+        // 每个顶点相邻的三角形，offsets[v]到offsets[v + 1]之间
+        std::vector<uint32_t> liveCount(vertexCount, 0);
+        for (size_t i = 0; i < triangleCount * 3; ++i) {
+            ++liveCount[indices[i]];
+        }
+        std::vector<uint32_t> offsets(vertexCount + 1, 0);
+        for (size_t v = 0; v < vertexCount; ++v) {
+            offsets[v + 1] = offsets[v] + liveCount[v];
+        }
+        std::vector<uint32_t> adjacency(offsets.back());
+        std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (size_t t = 0; t < triangleCount; ++t) {
+            for (int k = 0; k < 3; ++k) {
+                adjacency[cursor[indices[t * 3 + k]]++] = static_cast<uint32_t>(t);
+            }
+        }
+
+        std::vector<uint32_t> timestamps(vertexCount, 0);
+        std::vector<bool> emitted(triangleCount, false);
+        std::vector<uint32_t> deadEnds; // 最近输出的顶点，走进死胡同的时候先从这里找，它们很可能还在cache里面
+        std::vector<uint32_t> candidates;
+        uint32_t time = cacheSize + 1;
+        uint32_t scan = 0; // 死胡同栈也空了的时候按顶点顺序往后找
+        int64_t fanning = indices[0];
+        if (clusterStarts) clusterStarts->push_back(0);
+        while (fanning >= 0) {
+            candidates.clear();
+            auto vertex = static_cast<uint32_t>(fanning);
+            for (auto i = offsets[vertex]; i < offsets[vertex + 1]; ++i) {
+                auto triangle = adjacency[i];
+                if (emitted[triangle]) continue;
+                emitted[triangle] = true;
+                for (int k = 0; k < 3; ++k) {
+                    auto v = indices[triangle * 3 + k];
+                    result.push_back(v);
+                    deadEnds.push_back(v);
+                    candidates.push_back(v);
+                    --liveCount[v];
+                    if (time - timestamps[v] > cacheSize) timestamps[v] = time++;
+                }
+            }
+            fanning = NextVertex(candidates, liveCount, timestamps, time, cacheSize);
+            if (fanning < 0) {
+                fanning = SkipDeadEnd(deadEnds, liveCount, scan);
+                if (fanning >= 0 && clusterStarts && result.size() < triangleCount * 3) {
+                    clusterStarts->push_back(static_cast<uint32_t>(result.size() / 3));
+                }
+            }
+        }
+        return result;
+    }
+
+    // 在OptimizeVertexCache的结果上按簇重排，positions指向第一个顶点的位置，每个顶点间隔stride个float，
+    // 位置有components个分量，缺的分量当成0；2D的网格所有簇的排序依据都是0，顺序不会变
+    // 只能给有深度测试的管线用，没有深度测试的时候调用的地方要跳过
+    // 硬边界之间如果很长，簇内累计的ACMR降到这一段的threshold倍以下的时候再切一刀(软边界)，切在这里不会让cache命中变差多少
+    // 簇按(簇的中心 - 网格的中心)和簇的平均法线的点积从大到小排，越靠外、越朝外的簇越先画
+    static std::vector<uint32_t> OptimizeOverdraw(const std::vector<uint32_t>& indices, const float* positions, size_t stride, int components,
+                                                  const std::vector<uint32_t>& hardBoundaries, size_t vertexCount,
+                                                  float threshold = 1.05f, uint32_t cacheSize = DEFAULT_CACHE_SIZE) {
+        auto triangleCount = indices.size() / 3;
+        if (triangleCount == 0) return indices;
+        auto clusters = SplitClusters(indices, hardBoundaries, vertexCount, threshold, cacheSize);
+
+        auto position = [&](uint32_t v, int axis) { return axis < components ? positions[v * stride + axis] : 0.0f; };
+        // 网格的中心按三角形的面积加权
+        double meshCenter[3] = {};
+        double meshArea = 0.0;
+        struct Cluster final {
+            uint32_t first;
+            uint32_t last;
+            double sortKey = 0.0;
+        };
+        std::vector<Cluster> sorted;
+        std::vector<std::array<double, 7>> sums; // 中心*面积(3)、法线*面积(3)、面积
+        for (size_t c = 0; c < clusters.size(); ++c) {
+            auto first = clusters[c];
+            auto last = c + 1 < clusters.size() ? clusters[c + 1] : static_cast<uint32_t>(triangleCount);
+            std::array<double, 7> sum = {};
+            for (auto t = first; t < last; ++t) {
+                auto a = indices[t * 3], b = indices[t * 3 + 1], c2 = indices[t * 3 + 2];
+                double e1[3], e2[3], n[3];
+                for (int axis = 0; axis < 3; ++axis) {
+                    e1[axis] = position(b, axis) - position(a, axis);
+                    e2[axis] = position(c2, axis) - position(a, axis);
+                }
+                n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+                n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+                n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+                auto area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]) * 0.5;
+                for (int axis = 0; axis < 3; ++axis) {
+                    auto center = (position(a, axis) + position(b, axis) + position(c2, axis)) / 3.0;
+                    sum[axis] += center * area;
+                    sum[3 + axis] += n[axis] * 0.5; // 叉积的长度就是两倍面积，直接累加就是面积加权
+                    meshCenter[axis] += center * area;
+                }
+                sum[6] += area;
+                meshArea += area;
+            }
+            sorted.push_back({ first, last });
+            sums.push_back(sum);
+        }
+        if (meshArea > 0.0) {
+            for (auto& value : meshCenter) value /= meshArea;
+        }
+        for (size_t c = 0; c < sorted.size(); ++c) {
+            const auto& sum = sums[c];
+            if (sum[6] <= 0.0) continue;
+            double key = 0.0;
+            for (int axis = 0; axis < 3; ++axis) {
+                key += (sum[axis] / sum[6] - meshCenter[axis]) * sum[3 + axis];
+            }
+            sorted[c].sortKey = key / sum[6];
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster& a, const Cluster& b) { return a.sortKey > b.sortKey; });
+
+        std::vector<uint32_t> result;
+        result.reserve(indices.size());
+        for (const auto& cluster : sorted) {
+            result.insert(result.end(), indices.begin() + cluster.first * 3, indices.begin() + cluster.last * 3);
+        }
+        return result;
+    }
+
+    // 顶点按第一次出现的顺序重排，原地修改indices，没有被用到的顶点丢掉，返回新的顶点
+    template<typename Vertex>
+    static std::vector<Vertex> OptimizeVertexFetch(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices) {
+        constexpr uint32_t UNUSED = ~0u;
+        std::vector<uint32_t> remap(vertices.size(), UNUSED);
+        std::vector<Vertex> result;
+        result.reserve(vertices.size());
+        for (auto& index : indices) {
+            if (remap[index] == UNUSED) {
+                remap[index] = static_cast<uint32_t>(result.size());
+                result.push_back(vertices[index]);
+            }
+            index = remap[index];
+        }
+        return result;
+    }
+
+private:
+    // 选下一个扇出顶点：还有三角形没输出的顶点里面，在cache里面待得越久(但是剩下的三角形输出完之前不会被挤出去)的越好
+    static int64_t NextVertex(const std::vector<uint32_t>& candidates, const std::vector<uint32_t>& liveCount,
+                              const std::vector<uint32_t>& timestamps, uint32_t time, uint32_t cacheSize) {
+        int64_t best = -1;
+        int64_t bestPriority = -1;
+        for (auto v : candidates) {
+            if (liveCount[v] == 0) continue;
+            int64_t priority = 0;
+            // 每个三角形最多再带进来两个新顶点
+            if (time - timestamps[v] + 2 * liveCount[v] <= cacheSize) priority = time - timestamps[v];
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                best = v;
+            }
+        }
+        return best;
+    }
+
+    static int64_t SkipDeadEnd(std::vector<uint32_t>& deadEnds, const std::vector<uint32_t>& liveCount, uint32_t& scan) {
+        while (!deadEnds.empty()) {
+            auto v = deadEnds.back();
+            deadEnds.pop_back();
+            if (liveCount[v] > 0) return v;
+        }
+        while (scan < liveCount.size()) {
+            if (liveCount[scan] > 0) return scan++;
+            ++scan;
+        }
+        return -1;
+    }
+
+    // 返回每个簇的第一个三角形
+    // 簇重排之后每个簇开头的时候cache里面基本都是别的顶点，所以按清空的cache算每个簇的ACMR
+    // 硬边界之间的一段先算出自己的ACMR，再从头走一遍，累计的ACMR不超过它的threshold倍的时候就可以切开
+    static std::vector<uint32_t> SplitClusters(const std::vector<uint32_t>& indices, const std::vector<uint32_t>& hardBoundaries,
+                                               size_t vertexCount, float threshold, uint32_t cacheSize) {
+        auto triangleCount = static_cast<uint32_t>(indices.size() / 3);
+        std::vector<uint32_t> timestamps(vertexCount, 0);
+        uint32_t time = cacheSize + 1;
+        auto misses = [&](uint32_t t) {
+            uint32_t count = 0;
+            for (int k = 0; k < 3; ++k) {
+                auto v = indices[t * 3 + k];
+                if (time - timestamps[v] > cacheSize) {
+                    timestamps[v] = time++;
+                    ++count;
+                }
+            }
+            return count;
+        };
+        auto flush = [&]() { time += cacheSize + 1; };
+
+        std::vector<uint32_t> clusters;
+        for (size_t h = 0; h < std::max<size_t>(hardBoundaries.size(), 1); ++h) {
+            auto first = hardBoundaries.empty() ? 0 : hardBoundaries[h];
+            auto last = h + 1 < hardBoundaries.size() ? hardBoundaries[h + 1] : triangleCount;
+            flush();
+            uint32_t hardMisses = 0;
+            for (auto t = first; t < last; ++t) hardMisses += misses(t);
+            auto target = threshold * static_cast<double>(hardMisses) / std::max(1u, last - first);
+
+            flush();
+            uint32_t clusterStart = first;
+            uint32_t clusterMisses = 0;
+            clusters.push_back(first);
+            for (auto t = first; t < last; ++t) {
+                if (t > clusterStart && clusterMisses <= target * (t - clusterStart)) {
+                    clusters.push_back(t);
+                    clusterStart = t;
+                    clusterMisses = 0;
+                    flush();
+                }
+                clusterMisses += misses(t);
+            }
+        }
+        return clusters;
+    }
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// 把完全相同的顶点合并成一个，生成索引
+// 导入的模型一般是每个三角形自己带三个顶点(OBJ的面、没有索引的glTF)，共用的顶点重复存了很多份，
+// 合并之后顶点缓冲区变小，post-transform cache也能命中，vertex shader执行的次数跟着减少
+// 按字节比较，所以顶点结构体里面不能有未初始化的填充字节；0.0和-0.0会被当成不同的顶点，这种情况很少，不影响正确性
+class MeshWelder final {
+public:
+    template<typename Vertex>
+    struct Result final {
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+    };
+
+    // 输入是没有索引的顶点(每三个一个三角形)，输出的顶点按第一次出现的顺序排列
+    template<typename Vertex>
+    static Result<Vertex> Weld(const Vertex* vertices, size_t count) {
+        static_assert(std::is_trivially_copyable_v<Vertex>, "vertices are compared and hashed as raw bytes");
+        Result<Vertex> result;
+        result.indices.reserve(count);
+        // 开放寻址的哈希表，存的是result.vertices里面的下标，容量是2的幂并且至少是顶点数的两倍，线性探测很短
+        size_t capacity = 16;
+        while (capacity < count * 2) capacity <<= 1;
+        std::vector<uint32_t> table(capacity, EMPTY);
+        for (size_t i = 0; i < count; ++i) {
+            auto slot = Hash(&vertices[i], sizeof(Vertex)) & (capacity - 1);
+            while (table[slot] != EMPTY && std::memcmp(&result.vertices[table[slot]], &vertices[i], sizeof(Vertex)) != 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (table[slot] == EMPTY) {
+                table[slot] = static_cast<uint32_t>(result.vertices.size());
+                result.vertices.push_back(vertices[i]);
+            }
+            result.indices.push_back(table[slot]);
+        }
+        return result;
+    }
+
+    // 顶点不超过65535个的时候用16位的索引，索引缓冲区小一半，读索引的带宽也小一半
+    // 0xFFFF留出来，以后打开primitive restart的时候也不会冲突
+    static vk::IndexType IndexTypeFor(size_t vertexCount) {
+        return vertexCount <= 0xFFFF ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+    }
+
+    static size_t IndexSize(vk::IndexType type) {
+        return type == vk::IndexType::eUint16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    }
+
+    // 按indexType把索引打包成上传用的字节
+    static std::vector<uint8_t> PackIndices(const std::vector<uint32_t>& indices, vk::IndexType type) {
+        std::vector<uint8_t> packed(indices.size() * IndexSize(type));
+        if (type == vk::IndexType::eUint32) {
+            std::memcpy(packed.data(), indices.data(), packed.size());
+            return packed;
+        }
+        auto dst = reinterpret_cast<uint16_t*>(packed.data());
+        for (size_t i = 0; i < indices.size(); ++i) {
+            dst[i] = static_cast<uint16_t>(indices[i]);
+        }
+        return packed;
+    }
+
+private:
+    static constexpr uint32_t EMPTY = ~0u;
+
+    // FNV-1a，顶点只有几十个字节，够用了
+    static size_t Hash(const void* data, size_t size) {
+        auto bytes = static_cast<const uint8_t*>(data);
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// 给每一张显卡打分，挑分数最高的
+// 先淘汰渲染器用不了的设备(API版本太低、缺必需的扩展或特性、没有图形队列、不能显示到surface上)，
+// 剩下的先按设备类型排，同一类里面再按显存大小、可选扩展、队列族的能力加的分排
+// 集成显卡、lavapipe报告的DEVICE_LOCAL堆就是系统内存，可能比独显的显存还大，所以显存的分数不能跨过设备类型
+// 只有lavapipe这种软件实现的时候它也能被选中，只是分数最低
+class PhysicalDeviceSelector final {
+public:
+    struct Requirements final {
+        uint32_t apiVersion = VK_API_VERSION_1_2; // timeline semaphore是1.2的核心功能
+        std::vector<const char*> requiredExtensions;
+        std::vector<const char*> optionalExtensions; // 每支持一个加分
+        vk::SurfaceKHR surface; // 为空的时候(无窗口模式)不检查能不能显示
+        std::string preferred; // 用户指定的设备，可以是名字的一部分(不区分大小写)或者完整的UUID
+    };
+
+    struct Candidate final {
+        vk::PhysicalDevice device;
+        std::string name;
+        std::string uuid;
+        vk::PhysicalDeviceType type = vk::PhysicalDeviceType::eOther;
+        int64_t typeScore = 0; // 设备类型的分数，比较的时候先比这个
+        int64_t memoryScore = 0; // DEVICE_LOCAL显存加的分
+        int64_t featureScore = 0; // 可选扩展和队列族能力加的分
+        int64_t score = 0; // 上面三个的和
+        std::string rejectReason; // 为空表示可以用
+        bool preferred = false;
+    };
+
+    static constexpr int64_t DISCRETE_SCORE = 100000;
+    static constexpr int64_t INTEGRATED_SCORE = 50000;
+    static constexpr int64_t VIRTUAL_SCORE = 20000;
+    static constexpr int64_t OTHER_SCORE = 5000;
+    static constexpr int64_t CPU_SCORE = 1000;
+
+    static std::vector<Candidate> Rate(vk::Instance instance, const Requirements& requirements) {
+        std::vector<Candidate> candidates;
+        for (auto device : instance.enumeratePhysicalDevices()) {
+            candidates.push_back(RateDevice(device, requirements));
+        }
+        return candidates;
+    }
+
+    // 把所有设备的分数写到log里面，没有能用的设备的时候抛异常
+    // 用户指定的设备能用的时候优先选它，指定的设备不能用或者找不到的时候照常按分数选
+    static vk::PhysicalDevice Pick(vk::Instance instance, const Requirements& requirements, std::ostream& log) {
+        auto candidates = Rate(instance, requirements);
+        if (candidates.empty()) throw std::runtime_error("failed to find GPUs with Vulkan support!");
+
+        const Candidate* best = nullptr;
+        bool preferredFound = false;
+        log << "Physical devices:" << std::endl;
+        for (const auto& candidate : candidates) {
+            log << "  " << candidate.name << " [" << vk::to_string(candidate.type) << ", " << candidate.uuid << "]";
+            if (candidate.rejectReason.empty()) {
+                log << " score " << candidate.score << " (type " << candidate.typeScore << " + memory " << candidate.memoryScore
+                    << " + features " << candidate.featureScore << ")";
+            } else {
+                log << " rejected: " << candidate.rejectReason;
+            }
+            log << (candidate.preferred ? " (preferred)" : "") << std::endl;
+            if (!candidate.rejectReason.empty()) continue;
+            if (candidate.preferred && !preferredFound) {
+                best = &candidate;
+                preferredFound = true;
+            } else if (!preferredFound && (!best || Better(candidate, *best))) {
+                best = &candidate;
+            }
+        }
+        if (!requirements.preferred.empty() && !preferredFound) {
+            log << "Preferred device \"" << requirements.preferred << "\" is not available, picking by score" << std::endl;
+        }
+        if (!best) throw std::runtime_error("failed to find a suitable GPU!");
+        log << "Picked physical device: " << best->name << " (score " << best->score << ")" << std::endl;
+        return best->device;
+    }
+
+    // 设备类型不同的时候只看类型，同一类的再比总分
+    static bool Better(const Candidate& a, const Candidate& b) {
+        if (a.typeScore != b.typeScore) return a.typeScore > b.typeScore;
+        return a.score > b.score;
+    }
+
+    static std::string UuidToString(const vk::ArrayWrapper1D<uint8_t, VK_UUID_SIZE>& uuid) {
+        std::string result;
+        char hex[3];
+        for (size_t i = 0; i < VK_UUID_SIZE; ++i) {
+            if (i == 4 || i == 6 || i == 8 || i == 10) result.push_back('-');
+            std::snprintf(hex, sizeof(hex), "%02x", uuid[i]);
+            result += hex;
+        }
+        return result;
+    }
+
+private:
+    static Candidate RateDevice(vk::PhysicalDevice device, const Requirements& requirements) {
+        Candidate candidate;
+        candidate.device = device;
+        auto properties = device.getProperties();
+        auto idProperties = device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>().get<vk::PhysicalDeviceIDProperties>();
+        candidate.name = properties.deviceName.data();
+        candidate.uuid = UuidToString(idProperties.deviceUUID);
+        candidate.type = properties.deviceType;
+        candidate.preferred = Matches(candidate, requirements.preferred);
+
+        if (properties.apiVersion < requirements.apiVersion) {
+            candidate.rejectReason = "Vulkan " + std::to_string(VK_API_VERSION_MAJOR(properties.apiVersion)) + "." + std::to_string(VK_API_VERSION_MINOR(properties.apiVersion));
+            return candidate;
+        }
+
+        auto extensions = device.enumerateDeviceExtensionProperties();
+        auto hasExtension = [&extensions](const char* name) {
+            return std::any_of(extensions.begin(), extensions.end(), [name](const vk::ExtensionProperties& ext) { return std::strcmp(ext.extensionName, name) == 0; });
+        };
+        for (auto name : requirements.requiredExtensions) {
+            if (!hasExtension(name)) {
+                candidate.rejectReason = std::string("missing ") + name;
+                return candidate;
+            }
+        }
+
+        // 上面已经确认是1.2以上了，可以查Vulkan12Features
+        auto features = device.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceVulkan12Features>();
+        if (!features.get<vk::PhysicalDeviceVulkan12Features>().timelineSemaphore) {
+            candidate.rejectReason = "no timelineSemaphore";
+            return candidate;
+        }
+
+        auto queueFamilies = device.getQueueFamilyProperties();
+        bool hasGraphics = false, hasPresent = !requirements.surface, graphicsPresent = false;
+        bool dedicatedTransfer = false, dedicatedCompute = false, graphicsTimestamps = false;
+        for (uint32_t i = 0; i < queueFamilies.size(); ++i) {
+            auto flags = queueFamilies[i].queueFlags;
+            bool graphics = static_cast<bool>(flags & vk::QueueFlagBits::eGraphics);
+            bool compute = static_cast<bool>(flags & vk::QueueFlagBits::eCompute);
+            bool present = requirements.surface && device.getSurfaceSupportKHR(i, requirements.surface);
+            hasGraphics |= graphics;
+            hasPresent |= present;
+            graphicsPresent |= graphics && present;
+            if (graphics) graphicsTimestamps |= queueFamilies[i].timestampValidBits > 0;
+            if (!graphics && !compute && (flags & vk::QueueFlagBits::eTransfer)) dedicatedTransfer = true;
+            if (!graphics && compute) dedicatedCompute = true;
+        }
+        if (!hasGraphics) {
+            candidate.rejectReason = "no graphics queue";
+            return candidate;
+        }
+        if (!hasPresent) {
+            candidate.rejectReason = "cannot present to the surface";
+            return candidate;
+        }
+        if (requirements.surface && (device.getSurfaceFormatsKHR(requirements.surface).empty() || device.getSurfacePresentModesKHR(requirements.surface).empty())) {
+            candidate.rejectReason = "no surface formats or present modes";
+            return candidate;
+        }
+
+        switch (properties.deviceType) {
+            case vk::PhysicalDeviceType::eDiscreteGpu: candidate.typeScore = DISCRETE_SCORE; break;
+            case vk::PhysicalDeviceType::eIntegratedGpu: candidate.typeScore = INTEGRATED_SCORE; break;
+            case vk::PhysicalDeviceType::eVirtualGpu: candidate.typeScore = VIRTUAL_SCORE; break;
+            case vk::PhysicalDeviceType::eCpu: candidate.typeScore = CPU_SCORE; break;
+            default: candidate.typeScore = OTHER_SCORE; break;
+        }
+        // 每1GB的DEVICE_LOCAL显存加1000分，集成显卡的共享内存也算，只在同一类设备之间比较
+        auto memory = device.getMemoryProperties();
+        vk::DeviceSize deviceLocalBytes = 0;
+        for (uint32_t i = 0; i < memory.memoryHeapCount; ++i) {
+            if (memory.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal) {
+                deviceLocalBytes = std::max(deviceLocalBytes, memory.memoryHeaps[i].size);
+            }
+        }
+        candidate.memoryScore = static_cast<int64_t>(deviceLocalBytes / (1024 * 1024 * 1024)) * 1000;
+        for (auto name : requirements.optionalExtensions) {
+            if (hasExtension(name)) candidate.featureScore += 500;
+        }
+        if (dedicatedTransfer) candidate.featureScore += 500; // 上传可以和渲染并行
+        if (dedicatedCompute) candidate.featureScore += 500; // 可以异步计算
+        if (graphicsPresent) candidate.featureScore += 300; // 渲染和显示在同一个队列上，不需要转移所有权
+        if (graphicsTimestamps) candidate.featureScore += 100; // GPU profiler要用
+        candidate.score = candidate.typeScore + candidate.memoryScore + candidate.featureScore;
+        return candidate;
+    }
+
+    static bool Matches(const Candidate& candidate, const std::string& preferred) {
+        if (preferred.empty()) return false;
+        auto lower = [](std::string value) {
+            std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+            return value;
+        };
+        auto wanted = lower(preferred);
+        return candidate.uuid == wanted || lower(candidate.name).find(wanted) != std::string::npos;
+    }
+};
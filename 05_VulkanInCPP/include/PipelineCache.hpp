@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// 磁盘上持久化的VkPipelineCache，第二次启动的时候驱动就不用从头编译shader了
+class PipelineCache final {
+public:
+    void Init(vk::PhysicalDevice physicalDevice, vk::Device device, const std::string& path = "pipeline_cache.bin") {
+        this->device = device;
+        this->path = path;
+
+        auto initialData = LoadFile(physicalDevice);
+        warm = !initialData.empty();
+
+        auto createInfo = vk::PipelineCacheCreateInfo();
+        createInfo.setInitialDataSize(initialData.size())
+                  .setPInitialData(initialData.data());
+        cache = device.createPipelineCache(createInfo);
+        std::cout << "Pipeline cache: " << (warm ? "loaded " + std::to_string(initialData.size()) + " bytes from " + path : std::string("cold start")) << std::endl;
+    }
+
+    // 先写到临时文件，然后rename覆盖，这样写到一半程序崩了也不会留下一个损坏的缓存文件
+    void Save() {
+        if (!cache) return;
+        auto data = device.getPipelineCacheData(cache);
+        auto tempPath = path + ".tmp";
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                std::cerr << "failed to write pipeline cache: " << tempPath << std::endl;
+                return;
+            }
+            file.write(reinterpret_cast<const char*>(data.data()), data.size());
+            if (!file) {
+                std::cerr << "failed to write pipeline cache: " << tempPath << std::endl;
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(tempPath, path, error);
+        if (error) {
+            std::cerr << "failed to replace pipeline cache: " << error.message() << std::endl;
+        }
+    }
+
+    void Destroy() {
+        device.destroyPipelineCache(cache);
+        cache = nullptr;
+    }
+
+    vk::PipelineCache Get() const { return cache; }
+    bool IsWarm() const { return warm; }
+
+private:
+    vk::Device device;
+    vk::PipelineCache cache;
+    std::string path;
+    bool warm = false;
+
+    // 缓存数据的头部是VkPipelineCacheHeaderVersionOne，换了显卡或者驱动之后缓存就不能用了
+    std::vector<uint8_t> LoadFile(vk::PhysicalDevice physicalDevice) {
+        std::ifstream file(path, std::ios::ate | std::ios::binary);
+        if (!file.is_open()) return {};
+        std::vector<uint8_t> data(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(data.data()), data.size());
+
+        struct Header final {
+            uint32_t headerSize;
+            uint32_t headerVersion;
+            uint32_t vendorID;
+            uint32_t deviceID;
+            uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        } header;
+        if (data.size() < sizeof(Header)) return {};
+        memcpy(&header, data.data(), sizeof(Header));
+
+        auto properties = physicalDevice.getProperties();
+        if (header.headerSize < sizeof(Header) || header.headerSize > data.size()
+            || header.headerVersion != static_cast<uint32_t>(vk::PipelineCacheHeaderVersion::eOne)
+            || header.vendorID != properties.vendorID
+            || header.deviceID != properties.deviceID
+            || memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID.data(), VK_UUID_SIZE) != 0) {
+            std::cout << "Pipeline cache " << path << " does not match this device/driver, ignored" << std::endl;
+            return {};
+        }
+        return data;
+    }
+};
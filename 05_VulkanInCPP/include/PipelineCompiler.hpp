@@ -0,0 +1,236 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+// 描述一条图形管线需要的所有数据，提交之后在工作线程里面编译，所以这里面不能有指向调用者栈上的指针
+struct GraphicsPipelineDesc final {
+    std::string name;
+    std::string vertexShaderPath;
+    std::string fragmentShaderPath;
+    std::vector<vk::VertexInputBindingDescription> bindings;
+    std::vector<vk::VertexInputAttributeDescription> attributes;
+    vk::PrimitiveTopology topology = vk::PrimitiveTopology::eTriangleList;
+    vk::CullModeFlags cullMode = vk::CullModeFlagBits::eBack;
+    vk::FrontFace frontFace = vk::FrontFace::eClockwise;
+    vk::PipelineLayout layout;
+    vk::RenderPass renderPass; // 为空的时候用dynamic rendering，按下面的格式创建，不依赖任何render pass
+    uint32_t subpass = 0;
+    std::vector<vk::Format> colorFormats;
+    vk::Format depthFormat = vk::Format::eUndefined;
+};
+
+// 提交编译之后拿到的句柄，绘制的时候用Get()查询，还没编译好就返回空的管线，不会阻塞
+class PipelineHandle final {
+public:
+    PipelineHandle() = default;
+    explicit PipelineHandle(std::shared_future<vk::Pipeline> future) : future(std::move(future)) {}
+
+    bool IsReady() const {
+        return future.valid() && future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    vk::Pipeline Get() const {
+        return IsReady() ? future.get() : vk::Pipeline();
+    }
+
+    vk::Pipeline Wait() const {
+        return future.valid() ? future.get() : vk::Pipeline();
+    }
+
+private:
+    std::shared_future<vk::Pipeline> future;
+};
+
+// 管线编译服务，多个工作线程共用同一个VkPipelineCache并行编译
+// VkPipelineCache没有用EXTERNALLY_SYNCHRONIZED创建，驱动内部会加锁，所以多个线程可以同时用
+class PipelineCompiler final {
+public:
+    void Init(vk::Device device, vk::PipelineCache cache, uint32_t threadCount = ThreadPool::DefaultThreadCount()) {
+        this->device = device;
+        this->cache = cache;
+        pool = std::make_unique<ThreadPool>(threadCount);
+    }
+
+    // 等待所有提交的任务结束，然后销毁编译出来的所有管线
+    void Destroy() {
+        pool.reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto pipeline : pipelines) {
+            device.destroyPipeline(pipeline);
+        }
+        pipelines.clear();
+    }
+
+    PipelineHandle Submit(GraphicsPipelineDesc desc) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++pendingCount;
+        }
+        auto future = pool->Submit([this, desc = std::move(desc)](uint32_t) {
+            // 编译失败抛异常的时候也要把计数减掉，异常会保存在future里面
+            struct PendingGuard final {
+                PipelineCompiler* compiler;
+                ~PendingGuard() {
+                    std::lock_guard<std::mutex> lock(compiler->mutex);
+                    --compiler->pendingCount;
+                    compiler->idleCondition.notify_all();
+                }
+            } guard{this};
+            auto pipeline = Compile(desc);
+            std::lock_guard<std::mutex> lock(mutex);
+            pipelines.push_back(pipeline);
+            return pipeline;
+        });
+        return PipelineHandle(future.share());
+    }
+
+    // 等所有已经提交的管线都编译完，比如需要保存管线缓存之前
+    void WaitIdle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idleCondition.wait(lock, [this] { return pendingCount == 0; });
+    }
+
+private:
+    vk::Device device;
+    vk::PipelineCache cache;
+    std::unique_ptr<ThreadPool> pool;
+    std::mutex mutex;
+    std::vector<vk::Pipeline> pipelines;
+    uint32_t pendingCount = 0;
+    std::condition_variable idleCondition;
+
+    static std::vector<char> ReadSpirv(const std::string& filename) {
+        std::ifstream file(filename, std::ios::ate | std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("failed to open file: " + filename);
+        }
+        std::vector<char> buffer(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(buffer.data(), buffer.size());
+        return buffer;
+    }
+
+    // shader module在管线创建完之后就没用了，用UniqueShaderModule保证读文件、创建管线抛异常的时候也会被销毁
+    vk::UniqueShaderModule CreateShaderModule(const std::vector<char>& code) {
+        vk::ShaderModuleCreateInfo createInfo;
+        createInfo.setCodeSize(code.size())
+                  .setPCode(reinterpret_cast<const uint32_t*>(code.data()));
+        return device.createShaderModuleUnique(createInfo);
+    }
+
+    vk::Pipeline Compile(const GraphicsPipelineDesc& desc) {
+        auto startTime = std::chrono::steady_clock::now();
+        auto vertShaderModule = CreateShaderModule(ReadSpirv(desc.vertexShaderPath));
+        auto fragShaderModule = CreateShaderModule(ReadSpirv(desc.fragmentShaderPath));
+        auto vertShaderStageInfo = vk::PipelineShaderStageCreateInfo();
+        vertShaderStageInfo.setStage(vk::ShaderStageFlagBits::eVertex)
+                        .setModule(*vertShaderModule)
+                        .setPName("main");
+        auto fragShaderStageInfo = vk::PipelineShaderStageCreateInfo();
+        fragShaderStageInfo.setStage(vk::ShaderStageFlagBits::eFragment)
+                        .setModule(*fragShaderModule)
+                        .setPName("main");
+        auto shaderStageInfos = std::vector<vk::PipelineShaderStageCreateInfo>{vertShaderStageInfo, fragShaderStageInfo};
+
+        // 渲染管线中可以动态修改的数据
+        std::vector<vk::DynamicState> dynamicStates = {vk::DynamicState::eViewport, vk::DynamicState::eScissor};
+        vk::PipelineDynamicStateCreateInfo dynamicStateCreateInfo;
+        dynamicStateCreateInfo.setDynamicStates(dynamicStates);
+
+        // 这里应该对应OpenGL中的vao
+        auto vertexInputInfo = vk::PipelineVertexInputStateCreateInfo();
+        vertexInputInfo.setVertexBindingDescriptions(desc.bindings)
+                       .setVertexAttributeDescriptions(desc.attributes);
+
+        // 设置图元装配行为，对应OpenGL中的glDraw方法的一部分逻辑
+        auto inputAssemblyInfo = vk::PipelineInputAssemblyStateCreateInfo();
+        inputAssemblyInfo.setTopology(desc.topology)
+                         .setPrimitiveRestartEnable(false);
+
+        // 不要设置实际的数据，因为这些是动态修改的数据
+        auto viewportInfo = vk::PipelineViewportStateCreateInfo();
+        viewportInfo.setViewportCount(1)
+                    .setScissorCount(1);
+
+        // 光栅化行为
+        auto rasterizationInfo = vk::PipelineRasterizationStateCreateInfo();
+        rasterizationInfo.setDepthClampEnable(false) // 设置为true会导致不在视锥范围内的像素会被clamp到视锥的范围内，这种情况适合shadow map
+                         .setRasterizerDiscardEnable(false) // 文档写的很模糊，这个设置为true就会导致不会光栅化
+                         .setPolygonMode(vk::PolygonMode::eFill) // 线框模式，填充模式，点模式
+                         .setCullMode(desc.cullMode) // 剔除模式
+                         .setFrontFace(desc.frontFace) // 设置前面的点顺序
+                         .setDepthBiasEnable(false) // 偏移深度，用来解决shadow map出现摩尔纹的问题，是因为采样的频率跟不上导致会产生这些问题
+                         .setLineWidth(1.0f); // 线宽
+
+        // 采样行为
+        auto multiSampleInfo = vk::PipelineMultisampleStateCreateInfo();
+        multiSampleInfo.setRasterizationSamples(vk::SampleCountFlagBits::e1)
+                       .setSampleShadingEnable(false)
+                       .setMinSampleShading(1.0f)
+                       .setPSampleMask(nullptr)
+                       .setAlphaToCoverageEnable(false)
+                       .setAlphaToOneEnable(false);
+
+        // 深度测试和模板测试的设置
+        auto depthStencilInfo = vk::PipelineDepthStencilStateCreateInfo();
+
+        // 颜色混合行为
+        auto colorBlendAttachment = vk::PipelineColorBlendAttachmentState();
+        colorBlendAttachment.setColorWriteMask(vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA)
+                             .setBlendEnable(false) // 这里没有启用混合，所以后面的参数可以不用设置，但是启用了混合之后就一定要根据需求来配置参数
+                             .setSrcColorBlendFactor(vk::BlendFactor::eZero)
+                             .setDstColorBlendFactor(vk::BlendFactor::eZero)
+                             .setColorBlendOp(vk::BlendOp::eAdd)
+                             .setSrcAlphaBlendFactor(vk::BlendFactor::eZero)
+                             .setDstAlphaBlendFactor(vk::BlendFactor::eZero)
+                             .setAlphaBlendOp(vk::BlendOp::eAdd);
+
+        auto colorBlendInfo = vk::PipelineColorBlendStateCreateInfo();
+        colorBlendInfo.setLogicOpEnable(false)
+                      .setAttachments(colorBlendAttachment)
+                      .setLogicOp(vk::LogicOp::eCopy)
+                      .setBlendConstants({0.0f, 0.0f, 0.0f, 0.0f});
+
+        auto pipelineCreateInfo = vk::GraphicsPipelineCreateInfo();
+        pipelineCreateInfo.setStages(shaderStageInfos)
+                          .setPVertexInputState(&vertexInputInfo)
+                          .setPInputAssemblyState(&inputAssemblyInfo)
+                          .setPViewportState(&viewportInfo)
+                          .setPRasterizationState(&rasterizationInfo)
+                          .setPMultisampleState(&multiSampleInfo)
+                          .setPDepthStencilState(&depthStencilInfo)
+                          .setPColorBlendState(&colorBlendInfo)
+                          .setPDynamicState(&dynamicStateCreateInfo)
+                          .setLayout(desc.layout)
+                          .setRenderPass(desc.renderPass)
+                          .setSubpass(desc.subpass)
+                          .setBasePipelineHandle(nullptr)
+                          .setBasePipelineIndex(-1);
+        auto renderingInfo = vk::PipelineRenderingCreateInfo();
+        if (!desc.renderPass) {
+            renderingInfo.setColorAttachmentFormats(desc.colorFormats)
+                         .setDepthAttachmentFormat(desc.depthFormat);
+            pipelineCreateInfo.setPNext(&renderingInfo);
+        }
+
+        auto pipelineDetail = device.createGraphicsPipeline(cache, pipelineCreateInfo);
+        if (pipelineDetail.result != vk::Result::eSuccess) {
+            throw std::runtime_error("failed to create graphics pipeline: " + desc.name);
+        }
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        std::cout << "Pipeline " << desc.name << " compiled in " << elapsed << " ms" << std::endl;
+        return pipelineDetail.value;
+    }
+};
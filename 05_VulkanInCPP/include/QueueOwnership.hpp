@@ -0,0 +1,97 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstdint>
+
+// EXCLUSIVE的资源从一个队列族拿到另一个队列族使用的时候要转移所有权
+// 源队列上录制release，目标队列上录制acquire，两个barrier的队列族、范围(和image的布局)必须完全一样，
+// 目标队列的提交还要等源队列的提交执行完，一般是等源队列signal的timeline值
+// 两个队列族相同的时候不需要转移，Required()返回false，调用的地方直接用普通的barrier
+// 录制的函数可以传dispatcher，每帧录制的命令和其他命令一样走DeviceDispatch
+
+struct BufferOwnershipTransfer final {
+    vk::Buffer buffer;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = VK_WHOLE_SIZE;
+    uint32_t srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    uint32_t dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    vk::PipelineStageFlags srcStage; // 源队列上最后一次访问的阶段和类型
+    vk::AccessFlags srcAccess;
+    vk::PipelineStageFlags dstStage; // 目标队列上第一次访问的阶段和类型
+    vk::AccessFlags dstAccess;
+
+    bool Required() const { return srcQueueFamilyIndex != dstQueueFamilyIndex; }
+
+    // release的目标访问会被忽略，所以dst这一半是空的
+    template<typename Dispatch = VULKAN_HPP_DEFAULT_DISPATCHER_TYPE>
+    void RecordRelease(vk::CommandBuffer commandBuffer, const Dispatch& dispatch = VULKAN_HPP_DEFAULT_DISPATCHER) const {
+        auto barrier = Barrier();
+        barrier.setSrcAccessMask(srcAccess);
+        commandBuffer.pipelineBarrier(srcStage, vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, barrier, {}, dispatch);
+    }
+
+    // acquire的源访问会被忽略，srcStage要和目标队列等semaphore的阶段一样(这里用dstStage)，
+    // barrier的第一个同步范围才能和semaphore的等待连起来，acquire才会排在源队列的release后面
+    // 所以提交的时候semaphore的waitDstStageMask要包含dstStage
+    template<typename Dispatch = VULKAN_HPP_DEFAULT_DISPATCHER_TYPE>
+    void RecordAcquire(vk::CommandBuffer commandBuffer, const Dispatch& dispatch = VULKAN_HPP_DEFAULT_DISPATCHER) const {
+        auto barrier = Barrier();
+        barrier.setDstAccessMask(dstAccess);
+        commandBuffer.pipelineBarrier(dstStage, dstStage, {}, {}, barrier, {}, dispatch);
+    }
+
+private:
+    vk::BufferMemoryBarrier Barrier() const {
+        auto barrier = vk::BufferMemoryBarrier();
+        barrier.setSrcQueueFamilyIndex(srcQueueFamilyIndex)
+               .setDstQueueFamilyIndex(dstQueueFamilyIndex)
+               .setBuffer(buffer)
+               .setOffset(offset)
+               .setSize(size);
+        return barrier;
+    }
+};
+
+// image的布局转换也可以放在所有权转移里面一起做，release和acquire的oldLayout/newLayout要写一样的
+struct ImageOwnershipTransfer final {
+    vk::Image image;
+    vk::ImageSubresourceRange subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+    vk::ImageLayout oldLayout = vk::ImageLayout::eUndefined;
+    vk::ImageLayout newLayout = vk::ImageLayout::eUndefined;
+    uint32_t srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    uint32_t dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    vk::PipelineStageFlags srcStage;
+    vk::AccessFlags srcAccess;
+    vk::PipelineStageFlags dstStage;
+    vk::AccessFlags dstAccess;
+
+    bool Required() const { return srcQueueFamilyIndex != dstQueueFamilyIndex; }
+
+    template<typename Dispatch = VULKAN_HPP_DEFAULT_DISPATCHER_TYPE>
+    void RecordRelease(vk::CommandBuffer commandBuffer, const Dispatch& dispatch = VULKAN_HPP_DEFAULT_DISPATCHER) const {
+        auto barrier = Barrier();
+        barrier.setSrcAccessMask(srcAccess);
+        commandBuffer.pipelineBarrier(srcStage, vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, {}, barrier, dispatch);
+    }
+
+    template<typename Dispatch = VULKAN_HPP_DEFAULT_DISPATCHER_TYPE>
+    void RecordAcquire(vk::CommandBuffer commandBuffer, const Dispatch& dispatch = VULKAN_HPP_DEFAULT_DISPATCHER) const {
+        auto barrier = Barrier();
+        barrier.setDstAccessMask(dstAccess);
+        // 和BufferOwnershipTransfer一样，srcStage用semaphore等待的阶段，布局转换才会在release之后执行
+        commandBuffer.pipelineBarrier(dstStage, dstStage, {}, {}, {}, barrier, dispatch);
+    }
+
+private:
+    vk::ImageMemoryBarrier Barrier() const {
+        auto barrier = vk::ImageMemoryBarrier();
+        barrier.setOldLayout(oldLayout)
+               .setNewLayout(newLayout)
+               .setSrcQueueFamilyIndex(srcQueueFamilyIndex)
+               .setDstQueueFamilyIndex(dstQueueFamilyIndex)
+               .setImage(image)
+               .setSubresourceRange(subresourceRange);
+        return barrier;
+    }
+};
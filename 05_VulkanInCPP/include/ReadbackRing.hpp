@@ -0,0 +1,175 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include "GpuTimeline.hpp"
+#include "MemoryAllocator.hpp"
+
+// 把渲染结果从GPU读回CPU用的环形缓冲区
+// 每一帧在command buffer的最后录制copyImageToBuffer，拷贝到一个host visible(尽量是host cached)的buffer里面，
+// 等timeline到了这一帧的值之后再把数据交给回调，所以结果会晚几帧才拿到，但是CPU和GPU都不用互相等
+// 所有的slot都在用的时候直接跳过这一帧的回读，宁可丢帧也不让渲染等消费者
+class ReadbackRing final {
+public:
+    struct Result final {
+        uint64_t frameId = 0;
+        vk::Extent2D extent;
+        vk::Format format = vk::Format::eUndefined;
+        const void* data = nullptr; // 只在回调里面有效，回调返回之后这块内存会被下一次回读覆盖
+        vk::DeviceSize size = 0;
+    };
+    using Callback = std::function<void(const Result&)>;
+
+    void Init(MemoryAllocator& allocator, GpuTimeline& timeline, uint32_t slotCount, vk::DeviceSize slotSize, Callback callback) {
+        this->allocator = &allocator;
+        this->timeline = &timeline;
+        this->slotSize = slotSize;
+        this->callback = std::move(callback);
+
+        auto bufferInfo = vk::BufferCreateInfo();
+        bufferInfo.setSize(slotSize)
+                  .setUsage(vk::BufferUsageFlagBits::eTransferDst)
+                  .setSharingMode(vk::SharingMode::eExclusive);
+        slots.resize(slotCount);
+        for (uint32_t i = 0; i < slotCount; ++i) {
+            // CPU要读这块内存，没有HOST_CACHED的话每次读都直接走PCIe，会非常慢
+            slots[i].buffer = allocator.CreateBuffer(bufferInfo, vk::MemoryPropertyFlagBits::eHostVisible, vk::MemoryPropertyFlagBits::eHostCached);
+            freeSlots.push_back(i);
+        }
+    }
+
+    void Destroy() {
+        Drain();
+        for (auto& slot : slots) {
+            allocator->DestroyBuffer(slot.buffer);
+        }
+        slots.clear();
+        freeSlots.clear();
+    }
+
+    // 在endRenderPass之后、command buffer end之前调用，image此时必须是TRANSFER_SRC_OPTIMAL布局
+    // 返回false表示这一帧没有回读(没有空闲的slot或者image太大)
+    bool Record(vk::CommandBuffer commandBuffer, vk::Image image, vk::Format format, vk::Extent2D extent, uint64_t frameId) {
+        auto size = static_cast<vk::DeviceSize>(extent.width) * extent.height * BytesPerPixel(format);
+        if (freeSlots.empty() || size > slotSize) {
+            ++droppedCount;
+            return false;
+        }
+        auto index = freeSlots.front();
+        freeSlots.pop_front();
+        auto& slot = slots[index];
+        slot.frameId = frameId;
+        slot.extent = extent;
+        slot.format = format;
+        slot.size = size;
+
+        auto region = vk::BufferImageCopy();
+        region.setBufferOffset(0)
+              .setBufferRowLength(0) // 0表示紧密排列
+              .setBufferImageHeight(0)
+              .setImageSubresource({ vk::ImageAspectFlagBits::eColor, 0, 0, 1 })
+              .setImageOffset({ 0, 0, 0 })
+              .setImageExtent({ extent.width, extent.height, 1 });
+        commandBuffer.copyImageToBuffer(image, vk::ImageLayout::eTransferSrcOptimal, slot.buffer.buffer, region);
+
+        // 拷贝写入的数据要对CPU读取可见
+        auto barrier = vk::BufferMemoryBarrier();
+        barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+               .setDstAccessMask(vk::AccessFlagBits::eHostRead)
+               .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+               .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+               .setBuffer(slot.buffer.buffer)
+               .setOffset(0)
+               .setSize(size);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, {}, barrier, {});
+        recordedSlots.push_back(index);
+        return true;
+    }
+
+    // 录制好的command buffer提交之后调用，告诉回读这些拷贝在timeline的哪个值完成
+    void Submitted(uint64_t timelineValue) {
+        for (auto index : recordedSlots) {
+            slots[index].timelineValue = timelineValue;
+            inFlightSlots.push_back(index);
+        }
+        recordedSlots.clear();
+    }
+
+    // 每帧调用一次，把GPU已经写完的结果按帧的顺序交给回调，不会阻塞
+    void Poll() {
+        while (!inFlightSlots.empty() && timeline->IsCompleted(slots[inFlightSlots.front()].timelineValue)) {
+            DeliverFront();
+        }
+    }
+
+    // 等所有已经提交的回读都完成并交给回调，退出之前调用
+    void Drain() {
+        while (!inFlightSlots.empty()) {
+            timeline->Wait(slots[inFlightSlots.front()].timelineValue);
+            DeliverFront();
+        }
+    }
+
+    uint64_t DeliveredCount() const { return deliveredCount; }
+    uint64_t DroppedCount() const { return droppedCount; }
+
+    static vk::DeviceSize BytesPerPixel(vk::Format format) {
+        switch (format) {
+            case vk::Format::eR8G8B8A8Unorm:
+            case vk::Format::eR8G8B8A8Srgb:
+            case vk::Format::eB8G8R8A8Unorm:
+            case vk::Format::eB8G8R8A8Srgb:
+                return 4;
+            case vk::Format::eR16G16B16A16Sfloat:
+                return 8;
+            case vk::Format::eR32G32B32A32Sfloat:
+                return 16;
+            default:
+                throw std::runtime_error("unsupported readback format: " + vk::to_string(format));
+        }
+    }
+
+private:
+    struct Slot final {
+        AllocatedBuffer buffer;
+        uint64_t timelineValue = 0;
+        uint64_t frameId = 0;
+        vk::Extent2D extent;
+        vk::Format format = vk::Format::eUndefined;
+        vk::DeviceSize size = 0;
+    };
+
+    MemoryAllocator* allocator = nullptr;
+    GpuTimeline* timeline = nullptr;
+    vk::DeviceSize slotSize = 0;
+    Callback callback;
+    std::vector<Slot> slots;
+    std::deque<uint32_t> freeSlots;
+    std::vector<uint32_t> recordedSlots;
+    std::deque<uint32_t> inFlightSlots;
+    uint64_t deliveredCount = 0;
+    uint64_t droppedCount = 0;
+
+    void DeliverFront() {
+        auto index = inFlightSlots.front();
+        inFlightSlots.pop_front();
+        auto& slot = slots[index];
+        allocator->Invalidate(slot.buffer.allocation, 0, slot.size);
+        if (callback) {
+            Result result;
+            result.frameId = slot.frameId;
+            result.extent = slot.extent;
+            result.format = slot.format;
+            result.data = slot.buffer.allocation.mapped;
+            result.size = slot.size;
+            callback(result);
+        }
+        ++deliveredCount;
+        freeSlots.push_back(index);
+    }
+};
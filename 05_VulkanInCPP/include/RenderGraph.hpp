@@ -0,0 +1,759 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "DeletionQueue.hpp"
+#include "DeviceDispatch.hpp"
+#include "MemoryAllocator.hpp"
+
+// 帧图：每个pass声明自己读写哪些image，剩下的事情都由graph来做
+// - Compile的时候从输出(MarkOutput的资源和有副作用的pass)往回找，没有被用到的pass直接剔除
+// - 光栅化的pass自动创建render pass和framebuffer，render pass的initialLayout和finalLayout都是attachment的布局，
+//   布局转换全部由graph的barrier负责，不依赖subpass dependency
+//   用dynamic rendering的时候不创建render pass和framebuffer，直接把image view交给vkCmdBeginRendering
+// - 录制的时候跟踪每个image当前的布局和最后访问的阶段，每个pass开始之前把需要的barrier攒成一次pipelineBarrier
+// - graph自己创建的临时image(transient)按生命周期在同一块显存里面别名，生命周期不重叠的image共用内存，
+//   加pass的时候显存的峰值不会一直往上涨
+// pass按添加的顺序执行，所以读一个资源的pass要在写它的pass后面添加
+class RenderGraph final {
+public:
+    using Resource = uint32_t;
+    using Pass = uint32_t;
+    static constexpr uint32_t INVALID = ~0u;
+    static constexpr uint32_t MAX_ATTACHMENTS = 8;
+
+    // pass怎么使用一个image，决定了布局、管线阶段和访问类型
+    enum class Usage : uint8_t {
+        eColorAttachment,
+        eDepthAttachment,
+        eDepthRead, // 只读的深度，可以同时作为attachment做深度测试和在shader里面采样
+        eSampled,
+        eStorageRead,
+        eStorageWrite,
+        eTransferSrc,
+        eTransferDst,
+    };
+
+    struct ImageDesc final {
+        vk::Format format = vk::Format::eUndefined;
+        float scale = 1.0f; // 相对于Compile传进来的extent的大小，比如半分辨率的后处理是0.5
+        vk::SampleCountFlagBits samples = vk::SampleCountFlagBits::e1;
+    };
+
+    // 传给每个pass的录制回调，光栅化的pass自己决定用inline还是secondary command buffer开始render pass
+    class PassContext final {
+    public:
+        vk::CommandBuffer commandBuffer;
+        vk::Extent2D extent; // attachment的大小，不是光栅化的pass是0
+
+        void BeginRenderPass(vk::SubpassContents contents) {
+            graph->BeginRenderPass(*this, contents);
+        }
+
+        // 可以不调用，回调返回之后graph会结束还没结束的render pass
+        void EndRenderPass() {
+            if (!begun) return;
+            if (graph->dynamicRendering) {
+                commandBuffer.endRendering(*graph->dispatch);
+            } else {
+                commandBuffer.endRenderPass(*graph->dispatch);
+            }
+            begun = false;
+        }
+
+        // 录制secondary command buffer的时候继承用，dynamic rendering的时候render pass和framebuffer是空的，要用格式
+        vk::RenderPass RenderPass() const { return graph->passes[pass].renderPass; }
+        vk::Framebuffer Framebuffer() const { return framebuffer; } // BeginRenderPass之后才有
+        const std::vector<vk::Format>& ColorFormats() const { return graph->passes[pass].colorFormats; }
+        vk::Format DepthFormat() const { return graph->passes[pass].depthFormat; }
+        vk::Image GetImage(Resource resource) const { return graph->resources[resource].image; }
+        vk::ImageView GetView(Resource resource) const { return graph->resources[resource].view; }
+
+    private:
+        friend class RenderGraph;
+        RenderGraph* graph = nullptr;
+        Pass pass = INVALID;
+        vk::Framebuffer framebuffer;
+        bool begun = false;
+    };
+    using ExecuteFunction = std::function<void(PassContext&)>;
+
+    // dynamicRendering需要设备打开Vulkan 1.3的dynamicRendering特性
+    void Init(vk::Device device, MemoryAllocator& allocator, const DeviceDispatch& dispatch, bool dynamicRendering = false) {
+        this->device = device;
+        this->allocator = &allocator;
+        this->dispatch = &dispatch;
+        this->dynamicRendering = dynamicRendering;
+    }
+
+    // 调用之前GPU必须是空闲的
+    void Destroy() {
+        for (auto& entry : framebuffers) {
+            device.destroyFramebuffer(entry.framebuffer);
+        }
+        framebuffers.clear();
+        DestroyTransients();
+        for (auto& pass : passes) {
+            if (pass.renderPass) device.destroyRenderPass(pass.renderPass);
+            pass.renderPass = nullptr;
+        }
+    }
+
+    // 外部的image，比如交换链的image，每一帧用SetImportedImage告诉graph这一帧用哪一张
+    // 每一帧开始的时候认为它的内容不需要保留(布局是UNDEFINED)，之前对它的访问在initialStages里面完成，
+    // 比如acquire的semaphore等待的是COLOR_ATTACHMENT_OUTPUT
+    // finalLayout不是UNDEFINED的时候，所有的pass执行完之后转换到这个布局，比如交换链的PRESENT_SRC
+    Resource ImportImage(const char* name, vk::Format format, vk::ImageLayout finalLayout, vk::PipelineStageFlags initialStages) {
+        ResourceData resource;
+        resource.name = name;
+        resource.imported = true;
+        resource.desc.format = format;
+        resource.finalLayout = finalLayout;
+        resource.initialStages = initialStages;
+        resources.push_back(resource);
+        return static_cast<Resource>(resources.size() - 1);
+    }
+
+    // graph自己管理的临时image，只在一帧之内有意义，第一次使用之前的内容是未定义的(可能和别的image共用内存)
+    Resource CreateImage(const char* name, const ImageDesc& desc) {
+        ResourceData resource;
+        resource.name = name;
+        resource.desc = desc;
+        resources.push_back(resource);
+        return static_cast<Resource>(resources.size() - 1);
+    }
+
+    void SetImportedImage(Resource resource, vk::Image image, vk::ImageView view, vk::Extent2D extent) {
+        auto& data = resources[resource];
+        data.image = image;
+        data.view = view;
+        data.extent = extent;
+    }
+
+    // 这个资源在graph外面还要用(显示、回读)，写它的pass不会被剔除
+    void MarkOutput(Resource resource) {
+        resources[resource].output = true;
+    }
+
+    Pass AddPass(const char* name, ExecuteFunction execute) {
+        PassData pass;
+        pass.name = name;
+        pass.execute = std::move(execute);
+        passes.push_back(std::move(pass));
+        return static_cast<Pass>(passes.size() - 1);
+    }
+
+    // 没有clear的时候保留原来的内容(LOAD)，这时候也算是读
+    void WriteColor(Pass pass, Resource resource, std::optional<vk::ClearColorValue> clear = {}) {
+        auto use = ImageUse{ resource, Usage::eColorAttachment };
+        use.loadOp = clear ? vk::AttachmentLoadOp::eClear : vk::AttachmentLoadOp::eLoad;
+        if (clear) use.clearValue.setColor(*clear);
+        passes[pass].uses.push_back(use);
+    }
+
+    void WriteDepth(Pass pass, Resource resource, std::optional<vk::ClearDepthStencilValue> clear = {}) {
+        auto use = ImageUse{ resource, Usage::eDepthAttachment };
+        use.loadOp = clear ? vk::AttachmentLoadOp::eClear : vk::AttachmentLoadOp::eLoad;
+        if (clear) use.clearValue.setDepthStencil(*clear);
+        passes[pass].uses.push_back(use);
+    }
+
+    // eDepthRead、eSampled、eStorageRead、eTransferSrc
+    void Read(Pass pass, Resource resource, Usage usage) {
+        passes[pass].uses.push_back(ImageUse{ resource, usage });
+    }
+
+    // eStorageWrite、eTransferDst
+    void Write(Pass pass, Resource resource, Usage usage) {
+        passes[pass].uses.push_back(ImageUse{ resource, usage });
+    }
+
+    // 有副作用的pass(比如把结果拷贝到CPU)就算没有输出也不会被剔除
+    void SetSideEffect(Pass pass) {
+        passes[pass].sideEffect = true;
+    }
+
+    // 运行时临时跳过一个pass，比如不是每一帧都要回读，barrier会按实际执行的pass计算
+    void SetPassEnabled(Pass pass, bool enabled) {
+        passes[pass].enabled = enabled;
+    }
+
+    bool IsCulled(Pass pass) const { return passes[pass].culled; }
+    bool DynamicRendering() const { return dynamicRendering; }
+    vk::RenderPass GetRenderPass(Pass pass) const { return passes[pass].renderPass; }
+    // 用dynamic rendering的时候管线按attachment的格式创建
+    const std::vector<vk::Format>& GetColorFormats(Pass pass) const { return passes[pass].colorFormats; }
+    vk::Format GetDepthFormat(Pass pass) const { return passes[pass].depthFormat; }
+
+    // 加完所有的pass之后调用一次：剔除、创建render pass、分配临时image
+    void Compile(vk::Extent2D extent) {
+        Cull();
+        ComputeLifetimes();
+        for (uint32_t i = 0; i < passes.size(); ++i) {
+            if (passes[i].culled) continue;
+            SetupAttachments(i);
+            if (!dynamicRendering) CreateRenderPass(i);
+        }
+        AllocateTransients(extent);
+    }
+
+    // 大小改变之后重新创建临时image，旧的image、显存和所有的framebuffer交给deletionQueue，不用等GPU空闲
+    void Resize(vk::Extent2D extent, DeletionQueue& deletionQueue, uint64_t retireValue) {
+        ReleaseFramebuffers(deletionQueue, retireValue);
+        for (auto& resource : resources) {
+            if (resource.imported) continue;
+            deletionQueue.Push(resource.view, retireValue);
+            deletionQueue.Push(resource.image, retireValue);
+            resource.view = nullptr;
+            resource.image = nullptr;
+        }
+        if (transientMemory) deletionQueue.Push(transientMemory, retireValue);
+        AllocateTransients(extent);
+    }
+
+    // 外部的image view要销毁之前(比如重建交换链)调用，引用它们的framebuffer一起销毁
+    void ReleaseFramebuffers(DeletionQueue& deletionQueue, uint64_t retireValue) {
+        for (auto& entry : framebuffers) {
+            deletionQueue.Push(entry.framebuffer, retireValue);
+        }
+        framebuffers.clear();
+    }
+
+    // 用当前绑定的image找到(或者创建)这个pass的framebuffer，benchmark这种不走Execute的地方也可以用
+    // dynamic rendering不需要framebuffer，返回空的
+    vk::Framebuffer GetFramebuffer(Pass pass) {
+        const auto& data = passes[pass];
+        if (!data.renderPass) return nullptr;
+        FramebufferEntry key;
+        key.renderPass = data.renderPass;
+        key.extent = AttachmentExtent(data);
+        for (const auto& attachment : data.attachments) {
+            key.views[key.viewCount++] = resources[attachment.resource].view;
+        }
+        for (const auto& entry : framebuffers) {
+            if (entry.renderPass == key.renderPass && entry.extent == key.extent && entry.viewCount == key.viewCount &&
+                std::equal(entry.views.begin(), entry.views.begin() + entry.viewCount, key.views.begin())) {
+                return entry.framebuffer;
+            }
+        }
+        auto createInfo = vk::FramebufferCreateInfo();
+        createInfo.setRenderPass(key.renderPass)
+                  .setAttachmentCount(key.viewCount)
+                  .setPAttachments(key.views.data())
+                  .setWidth(key.extent.width)
+                  .setHeight(key.extent.height)
+                  .setLayers(1);
+        key.framebuffer = device.createFramebuffer(createInfo);
+        framebuffers.push_back(key);
+        return key.framebuffer;
+    }
+
+    // 不插barrier，只开始一个pass的渲染，给只录制不提交的性能测试用，image要先用SetImportedImage绑定好
+    PassContext BeginPass(Pass pass, vk::CommandBuffer commandBuffer, vk::SubpassContents contents) {
+        PassContext context;
+        context.graph = this;
+        context.pass = pass;
+        context.commandBuffer = commandBuffer;
+        context.extent = AttachmentExtent(passes[pass]);
+        context.BeginRenderPass(contents);
+        return context;
+    }
+
+    // 按顺序录制所有没有被剔除、没有被跳过的pass，每个pass前面最多一次pipelineBarrier
+    void Execute(vk::CommandBuffer commandBuffer) {
+        for (auto& resource : resources) {
+            if (resource.imported) {
+                resource.layout = vk::ImageLayout::eUndefined;
+                resource.stages = resource.initialStages;
+                resource.accesses = {};
+            } else {
+                resource.firstUse = true;
+            }
+        }
+        for (uint32_t i = 0; i < passes.size(); ++i) {
+            auto& pass = passes[i];
+            if (pass.culled || !pass.enabled) continue;
+            BeginBarriers();
+            for (const auto& use : pass.uses) {
+                Transition(use.resource, UsageInfo(use.usage));
+            }
+            FlushBarriers(commandBuffer);
+
+            PassContext context;
+            context.graph = this;
+            context.pass = i;
+            context.commandBuffer = commandBuffer;
+            context.extent = AttachmentExtent(pass);
+            pass.execute(context);
+            context.EndRenderPass();
+        }
+        // 输出的image转换到外面要用的布局
+        BeginBarriers();
+        for (uint32_t i = 0; i < resources.size(); ++i) {
+            auto& resource = resources[i];
+            if (!resource.imported || resource.finalLayout == vk::ImageLayout::eUndefined || resource.layout == resource.finalLayout) continue;
+            Transition(i, { resource.finalLayout, vk::PipelineStageFlagBits::eBottomOfPipe, {}, {} });
+        }
+        FlushBarriers(commandBuffer);
+    }
+
+    void Print(std::ostream& out) const {
+        out << "Render graph:";
+        for (const auto& pass : passes) {
+            out << " " << pass.name << (pass.culled ? " (culled)" : "");
+        }
+        out << std::endl;
+        uint32_t transientCount = 0;
+        for (const auto& resource : resources) {
+            if (!resource.imported && resource.image) ++transientCount;
+        }
+        out << "  " << transientCount << " transient images, " << transientBytes / 1024.0 / 1024.0 << " MB aliased ("
+            << unaliasedBytes / 1024.0 / 1024.0 << " MB without aliasing)" << std::endl;
+    }
+
+private:
+    struct ImageUse final {
+        Resource resource = INVALID;
+        Usage usage = Usage::eSampled;
+        vk::AttachmentLoadOp loadOp = vk::AttachmentLoadOp::eDontCare;
+        vk::ClearValue clearValue;
+    };
+
+    struct Attachment final {
+        Resource resource = INVALID;
+        vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+        vk::AttachmentLoadOp loadOp = vk::AttachmentLoadOp::eDontCare;
+        vk::AttachmentStoreOp storeOp = vk::AttachmentStoreOp::eStore;
+        bool depth = false;
+    };
+
+    struct PassData final {
+        const char* name = "";
+        ExecuteFunction execute;
+        std::vector<ImageUse> uses;
+        bool sideEffect = false;
+        bool culled = false;
+        bool enabled = true;
+        vk::RenderPass renderPass; // 没有attachment的pass或者用dynamic rendering的时候为空
+        std::vector<Attachment> attachments; // framebuffer里面的顺序，颜色在前深度在后
+        std::vector<vk::ClearValue> clearValues;
+        std::vector<vk::Format> colorFormats;
+        vk::Format depthFormat = vk::Format::eUndefined;
+    };
+
+    struct ResourceData final {
+        const char* name = "";
+        bool imported = false;
+        bool output = false;
+        ImageDesc desc;
+        vk::ImageLayout finalLayout = vk::ImageLayout::eUndefined;
+        vk::PipelineStageFlags initialStages;
+        vk::ImageUsageFlags usage; // 所有pass的用法合起来，创建临时image的时候用
+        vk::Image image;
+        vk::ImageView view;
+        vk::Extent2D extent;
+        uint32_t firstPass = INVALID; // 没有被剔除的pass里面第一次和最后一次使用
+        uint32_t lastPass = INVALID;
+        vk::DeviceSize offset = 0; // 在transientMemory里面的偏移
+        vk::DeviceSize size = 0;
+        vk::DeviceSize alignment = 1;
+        std::vector<Resource> aliases; // 内存有重叠的临时image，包括自己
+        // 录制时的状态，上一次barrier之后对它的访问
+        vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+        vk::PipelineStageFlags stages;
+        vk::AccessFlags accesses;
+        bool firstUse = true;
+    };
+
+    struct Access final {
+        vk::ImageLayout layout;
+        vk::PipelineStageFlags stages;
+        vk::AccessFlags access;
+        vk::ImageUsageFlags imageUsage;
+    };
+
+    struct FramebufferEntry final {
+        vk::RenderPass renderPass;
+        vk::Extent2D extent;
+        std::array<vk::ImageView, MAX_ATTACHMENTS> views;
+        uint32_t viewCount = 0;
+        vk::Framebuffer framebuffer;
+    };
+
+    static constexpr vk::AccessFlags WRITE_ACCESS = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite |
+                                                    vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eTransferWrite |
+                                                    vk::AccessFlagBits::eHostWrite | vk::AccessFlagBits::eMemoryWrite;
+
+    vk::Device device;
+    MemoryAllocator* allocator = nullptr;
+    const DeviceDispatch* dispatch = nullptr;
+    bool dynamicRendering = false;
+    std::vector<PassData> passes;
+    std::vector<ResourceData> resources;
+    std::vector<FramebufferEntry> framebuffers; // pass数量乘上交换链image的数量，很少，直接线性查找
+    Allocation transientMemory;
+    vk::DeviceSize transientBytes = 0;
+    vk::DeviceSize unaliasedBytes = 0;
+    // 正在攒的barrier，每一帧都复用，不在录制的时候分配内存
+    std::vector<vk::ImageMemoryBarrier> pendingBarriers;
+    vk::PipelineStageFlags pendingSrcStages;
+    vk::PipelineStageFlags pendingDstStages;
+
+    static Access UsageInfo(Usage usage) {
+        using Stage = vk::PipelineStageFlagBits;
+        using AccessBit = vk::AccessFlagBits;
+        using ImageUsage = vk::ImageUsageFlagBits;
+        const auto depthStages = Stage::eEarlyFragmentTests | Stage::eLateFragmentTests;
+        switch (usage) {
+            case Usage::eColorAttachment:
+                return { vk::ImageLayout::eColorAttachmentOptimal, Stage::eColorAttachmentOutput, AccessBit::eColorAttachmentRead | AccessBit::eColorAttachmentWrite, ImageUsage::eColorAttachment };
+            case Usage::eDepthAttachment:
+                return { vk::ImageLayout::eDepthStencilAttachmentOptimal, depthStages, AccessBit::eDepthStencilAttachmentRead | AccessBit::eDepthStencilAttachmentWrite, ImageUsage::eDepthStencilAttachment };
+            case Usage::eDepthRead:
+                return { vk::ImageLayout::eDepthStencilReadOnlyOptimal, depthStages | Stage::eFragmentShader | Stage::eComputeShader, AccessBit::eDepthStencilAttachmentRead | AccessBit::eShaderRead, ImageUsage::eSampled };
+            case Usage::eSampled:
+                return { vk::ImageLayout::eShaderReadOnlyOptimal, Stage::eFragmentShader | Stage::eComputeShader, AccessBit::eShaderRead, ImageUsage::eSampled };
+            case Usage::eStorageRead:
+                return { vk::ImageLayout::eGeneral, Stage::eFragmentShader | Stage::eComputeShader, AccessBit::eShaderRead, ImageUsage::eStorage };
+            case Usage::eStorageWrite:
+                return { vk::ImageLayout::eGeneral, Stage::eFragmentShader | Stage::eComputeShader, AccessBit::eShaderRead | AccessBit::eShaderWrite, ImageUsage::eStorage };
+            case Usage::eTransferSrc:
+                return { vk::ImageLayout::eTransferSrcOptimal, Stage::eTransfer, AccessBit::eTransferRead, ImageUsage::eTransferSrc };
+            case Usage::eTransferDst:
+                return { vk::ImageLayout::eTransferDstOptimal, Stage::eTransfer, AccessBit::eTransferWrite, ImageUsage::eTransferDst };
+        }
+        throw std::runtime_error("unknown render graph usage");
+    }
+
+    static bool IsAttachment(Usage usage) {
+        return usage == Usage::eColorAttachment || usage == Usage::eDepthAttachment;
+    }
+
+    static vk::ImageAspectFlags AspectOf(vk::Format format) {
+        switch (format) {
+            case vk::Format::eD16Unorm:
+            case vk::Format::eX8D24UnormPack32:
+            case vk::Format::eD32Sfloat:
+                return vk::ImageAspectFlagBits::eDepth;
+            case vk::Format::eD16UnormS8Uint:
+            case vk::Format::eD24UnormS8Uint:
+            case vk::Format::eD32SfloatS8Uint:
+                return vk::ImageAspectFlagBits::eDepth | vk::ImageAspectFlagBits::eStencil;
+            default:
+                return vk::ImageAspectFlagBits::eColor;
+        }
+    }
+
+    // 从后往前找：有副作用的pass、写了输出(或者后面要读的资源)的pass要保留，保留的pass读的资源也变成需要的
+    void Cull() {
+        std::vector<bool> needed(resources.size(), false);
+        for (uint32_t i = 0; i < resources.size(); ++i) {
+            needed[i] = resources[i].output;
+        }
+        for (uint32_t i = static_cast<uint32_t>(passes.size()); i-- > 0;) {
+            auto& pass = passes[i];
+            bool alive = pass.sideEffect;
+            for (const auto& use : pass.uses) {
+                if ((UsageInfo(use.usage).access & WRITE_ACCESS) && needed[use.resource]) alive = true;
+            }
+            pass.culled = !alive;
+            if (!alive) continue;
+            for (const auto& use : pass.uses) {
+                bool reads = !(UsageInfo(use.usage).access & WRITE_ACCESS) || use.loadOp == vk::AttachmentLoadOp::eLoad ||
+                             use.usage == Usage::eStorageWrite; // storage image一般是读改写
+                if (reads) needed[use.resource] = true;
+            }
+        }
+    }
+
+    void ComputeLifetimes() {
+        for (uint32_t i = 0; i < passes.size(); ++i) {
+            if (passes[i].culled) continue;
+            for (const auto& use : passes[i].uses) {
+                auto& resource = resources[use.resource];
+                if (resource.firstPass == INVALID) resource.firstPass = i;
+                resource.lastPass = i;
+                resource.usage |= UsageInfo(use.usage).imageUsage;
+            }
+        }
+    }
+
+    // 颜色在前，深度在最后，render pass、framebuffer和vkCmdBeginRendering都用这个顺序
+    void SetupAttachments(Pass index) {
+        auto& pass = passes[index];
+        for (auto usage : { Usage::eColorAttachment, Usage::eDepthAttachment }) {
+            for (const auto& use : pass.uses) {
+                if (use.usage != usage) continue;
+                const auto& resource = resources[use.resource];
+                // 临时image在这个pass之后没有人读的话，写完的内容可以不存回显存(tile-based的GPU上能省带宽)
+                bool store = resource.imported || resource.lastPass != index;
+                Attachment attachment;
+                attachment.resource = use.resource;
+                attachment.layout = UsageInfo(usage).layout;
+                attachment.loadOp = use.loadOp;
+                attachment.storeOp = store ? vk::AttachmentStoreOp::eStore : vk::AttachmentStoreOp::eDontCare;
+                attachment.depth = usage == Usage::eDepthAttachment;
+                if (attachment.depth) {
+                    pass.depthFormat = resource.desc.format;
+                } else {
+                    pass.colorFormats.push_back(resource.desc.format);
+                }
+                pass.attachments.push_back(attachment);
+                pass.clearValues.push_back(use.clearValue);
+            }
+        }
+        if (pass.attachments.size() > MAX_ATTACHMENTS) throw std::runtime_error(std::string("too many attachments in pass ") + pass.name);
+    }
+
+    void CreateRenderPass(Pass index) {
+        auto& pass = passes[index];
+        if (pass.attachments.empty()) return;
+        std::vector<vk::AttachmentDescription> descriptions;
+        std::vector<vk::AttachmentReference> colorRefs;
+        std::optional<vk::AttachmentReference> depthRef;
+        for (const auto& attachment : pass.attachments) {
+            const auto& resource = resources[attachment.resource];
+            auto description = vk::AttachmentDescription();
+            description.setFormat(resource.desc.format)
+                       .setSamples(resource.desc.samples)
+                       .setLoadOp(attachment.loadOp)
+                       .setStoreOp(attachment.storeOp)
+                       .setStencilLoadOp(attachment.loadOp)
+                       .setStencilStoreOp(attachment.storeOp)
+                       .setInitialLayout(attachment.layout)
+                       .setFinalLayout(attachment.layout);
+            auto reference = vk::AttachmentReference(static_cast<uint32_t>(descriptions.size()), attachment.layout);
+            if (attachment.depth) {
+                depthRef = reference;
+            } else {
+                colorRefs.push_back(reference);
+            }
+            descriptions.push_back(description);
+        }
+
+        auto subpass = vk::SubpassDescription();
+        subpass.setPipelineBindPoint(vk::PipelineBindPoint::eGraphics)
+               .setColorAttachments(colorRefs)
+               .setPDepthStencilAttachment(depthRef ? &*depthRef : nullptr);
+        auto createInfo = vk::RenderPassCreateInfo();
+        createInfo.setAttachments(descriptions)
+                  .setSubpasses(subpass);
+        pass.renderPass = device.createRenderPass(createInfo);
+    }
+
+    vk::Extent2D AttachmentExtent(const PassData& pass) const {
+        return pass.attachments.empty() ? vk::Extent2D() : resources[pass.attachments.front().resource].extent;
+    }
+
+    void BeginRenderPass(PassContext& context, vk::SubpassContents contents) {
+        const auto& pass = passes[context.pass];
+        if (pass.attachments.empty()) throw std::runtime_error(std::string("pass has no attachments: ") + pass.name);
+        if (dynamicRendering) {
+            BeginRendering(context, contents);
+            return;
+        }
+        context.framebuffer = GetFramebuffer(context.pass);
+        auto beginInfo = vk::RenderPassBeginInfo();
+        beginInfo.setRenderPass(pass.renderPass)
+                 .setFramebuffer(context.framebuffer)
+                 .setRenderArea({ {0, 0}, context.extent })
+                 .setClearValues(pass.clearValues);
+        context.commandBuffer.beginRenderPass(beginInfo, contents, *dispatch);
+        context.begun = true;
+    }
+
+    // 加载和存储的方式每一帧直接传进去，不需要任何预先创建的对象，交换链重建的时候也没有东西要重建
+    void BeginRendering(PassContext& context, vk::SubpassContents contents) {
+        const auto& pass = passes[context.pass];
+        std::array<vk::RenderingAttachmentInfo, MAX_ATTACHMENTS> colorInfos;
+        uint32_t colorCount = 0;
+        auto depthInfo = vk::RenderingAttachmentInfo();
+        bool hasDepth = false;
+        for (size_t i = 0; i < pass.attachments.size(); ++i) {
+            const auto& attachment = pass.attachments[i];
+            auto info = vk::RenderingAttachmentInfo();
+            info.setImageView(resources[attachment.resource].view)
+                .setImageLayout(attachment.layout)
+                .setLoadOp(attachment.loadOp)
+                .setStoreOp(attachment.storeOp)
+                .setClearValue(pass.clearValues[i]);
+            if (attachment.depth) {
+                depthInfo = info;
+                hasDepth = true;
+            } else {
+                colorInfos[colorCount++] = info;
+            }
+        }
+        auto renderingInfo = vk::RenderingInfo();
+        renderingInfo.setRenderArea({ {0, 0}, context.extent })
+                     .setLayerCount(1)
+                     .setColorAttachmentCount(colorCount)
+                     .setPColorAttachments(colorInfos.data())
+                     .setPDepthAttachment(hasDepth ? &depthInfo : nullptr);
+        if (contents == vk::SubpassContents::eSecondaryCommandBuffers) {
+            renderingInfo.setFlags(vk::RenderingFlagBits::eContentsSecondaryCommandBuffers);
+        }
+        context.commandBuffer.beginRendering(renderingInfo, *dispatch);
+        context.begun = true;
+    }
+
+    // 贪心地给临时image分配内存：从大到小，每个image放在最低的、不和生命周期重叠的image冲突的位置
+    void AllocateTransients(vk::Extent2D extent) {
+        std::vector<Resource> transients;
+        vk::MemoryRequirements combined;
+        combined.memoryTypeBits = ~0u;
+        combined.alignment = 1;
+        unaliasedBytes = 0;
+        for (uint32_t i = 0; i < resources.size(); ++i) {
+            auto& resource = resources[i];
+            if (resource.imported || resource.firstPass == INVALID) continue;
+            resource.extent = vk::Extent2D(std::max(1u, static_cast<uint32_t>(std::lround(extent.width * resource.desc.scale))),
+                                           std::max(1u, static_cast<uint32_t>(std::lround(extent.height * resource.desc.scale))));
+            auto createInfo = vk::ImageCreateInfo();
+            createInfo.setImageType(vk::ImageType::e2D)
+                      .setFormat(resource.desc.format)
+                      .setExtent({ resource.extent.width, resource.extent.height, 1 })
+                      .setMipLevels(1)
+                      .setArrayLayers(1)
+                      .setSamples(resource.desc.samples)
+                      .setTiling(vk::ImageTiling::eOptimal)
+                      .setUsage(resource.usage)
+                      .setSharingMode(vk::SharingMode::eExclusive)
+                      .setInitialLayout(vk::ImageLayout::eUndefined);
+            resource.image = device.createImage(createInfo);
+            auto requirements = device.getImageMemoryRequirements(resource.image);
+            resource.size = requirements.size;
+            resource.alignment = requirements.alignment;
+            combined.memoryTypeBits &= requirements.memoryTypeBits;
+            combined.alignment = std::max(combined.alignment, requirements.alignment);
+            unaliasedBytes += requirements.size;
+            transients.push_back(i);
+        }
+        transientBytes = 0;
+        if (transients.empty()) return;
+        if (combined.memoryTypeBits == 0) throw std::runtime_error("transient images have no common memory type!");
+
+        auto overlapsInTime = [](const ResourceData& a, const ResourceData& b) {
+            return a.firstPass <= b.lastPass && b.firstPass <= a.lastPass;
+        };
+        auto overlapsInMemory = [](const ResourceData& a, const ResourceData& b) {
+            return a.offset < b.offset + b.size && b.offset < a.offset + a.size;
+        };
+        std::sort(transients.begin(), transients.end(), [this](Resource a, Resource b) { return resources[a].size > resources[b].size; });
+        std::vector<Resource> placed;
+        for (auto index : transients) {
+            auto& resource = resources[index];
+            // 候选的位置是0和每个冲突的image的结尾，取放得下的最小的那个
+            std::vector<vk::DeviceSize> candidates = { 0 };
+            for (auto other : placed) {
+                if (overlapsInTime(resource, resources[other])) candidates.push_back(resources[other].offset + resources[other].size);
+            }
+            std::sort(candidates.begin(), candidates.end());
+            for (auto candidate : candidates) {
+                resource.offset = (candidate + resource.alignment - 1) / resource.alignment * resource.alignment;
+                bool fits = std::none_of(placed.begin(), placed.end(), [&](Resource other) {
+                    return overlapsInTime(resource, resources[other]) && overlapsInMemory(resource, resources[other]);
+                });
+                if (fits) break;
+            }
+            placed.push_back(index);
+            transientBytes = std::max(transientBytes, resource.offset + resource.size);
+        }
+
+        combined.size = transientBytes;
+        transientMemory = allocator->Allocate(combined, vk::MemoryPropertyFlagBits::eDeviceLocal, {}, ResourceKind::eOptimal);
+        for (auto index : transients) {
+            auto& resource = resources[index];
+            device.bindImageMemory(resource.image, transientMemory.memory, transientMemory.offset + resource.offset);
+            auto viewInfo = vk::ImageViewCreateInfo();
+            viewInfo.setImage(resource.image)
+                    .setViewType(vk::ImageViewType::e2D)
+                    .setFormat(resource.desc.format)
+                    .setSubresourceRange({ AspectOf(resource.desc.format), 0, 1, 0, 1 });
+            resource.view = device.createImageView(viewInfo);
+            // 内存有重叠的image之间也要同步，不管是这一帧前面用过的还是上一帧用过的
+            resource.aliases.clear();
+            for (auto other : transients) {
+                if (overlapsInMemory(resource, resources[other])) resource.aliases.push_back(other);
+            }
+            resource.layout = vk::ImageLayout::eUndefined;
+            resource.stages = {};
+            resource.accesses = {};
+        }
+    }
+
+    void DestroyTransients() {
+        for (auto& resource : resources) {
+            if (resource.imported) continue;
+            if (resource.view) device.destroyImageView(resource.view);
+            if (resource.image) device.destroyImage(resource.image);
+            resource.view = nullptr;
+            resource.image = nullptr;
+        }
+        allocator->Free(transientMemory);
+    }
+
+    void BeginBarriers() {
+        pendingBarriers.clear();
+        pendingSrcStages = {};
+        pendingDstStages = {};
+    }
+
+    // 读之后再读、布局也一样的时候不需要barrier，只把阶段记下来，之后有人写的时候要等这些读完成
+    void Transition(Resource index, const Access& access) {
+        auto& resource = resources[index];
+        auto oldLayout = resource.layout;
+        auto srcStages = resource.stages;
+        auto srcAccess = resource.accesses & WRITE_ACCESS;
+        bool write = static_cast<bool>(access.access & WRITE_ACCESS);
+        bool needed = oldLayout != access.layout || write || srcAccess;
+        if (!resource.imported && resource.firstUse) {
+            // 临时image每一帧第一次用的时候内容不要，但是要等所有共用这块内存的image之前的访问完成
+            resource.firstUse = false;
+            oldLayout = vk::ImageLayout::eUndefined;
+            srcStages = {};
+            srcAccess = {};
+            for (auto alias : resource.aliases) {
+                srcStages |= resources[alias].stages;
+                srcAccess |= resources[alias].accesses & WRITE_ACCESS;
+            }
+            needed = true;
+        }
+        if (!needed) {
+            resource.stages |= access.stages;
+            resource.accesses |= access.access;
+            return;
+        }
+        auto barrier = vk::ImageMemoryBarrier();
+        barrier.setOldLayout(oldLayout)
+               .setNewLayout(access.layout)
+               .setSrcAccessMask(srcAccess)
+               .setDstAccessMask(access.access)
+               .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+               .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+               .setImage(resource.image)
+               .setSubresourceRange({ AspectOf(resource.desc.format), 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS });
+        pendingBarriers.push_back(barrier);
+        pendingSrcStages |= srcStages ? srcStages : vk::PipelineStageFlags(vk::PipelineStageFlagBits::eTopOfPipe);
+        pendingDstStages |= access.stages;
+        resource.layout = access.layout;
+        resource.stages = access.stages;
+        resource.accesses = access.access;
+    }
+
+    void FlushBarriers(vk::CommandBuffer commandBuffer) {
+        if (pendingBarriers.empty()) return;
+        commandBuffer.pipelineBarrier(pendingSrcStages, pendingDstStages, {}, {}, {}, pendingBarriers, *dispatch);
+    }
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstring>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "DeviceDispatch.hpp"
+#include "GpuTimeline.hpp"
+#include "MemoryAllocator.hpp"
+#include "QueueOwnership.hpp"
+
+// 上传数据到DEVICE_LOCAL显存用的暂存环形缓冲区
+// 数据先memcpy到一直映射着的host visible环形buffer中，然后攒成一批copyBuffer命令一起提交
+// 每一批提交都会signal一个timeline的值，GPU执行到这个值之后这一批占用的环形空间就可以被重新使用
+// 有专用的传输队列的时候拷贝在传输队列上执行，和渲染并行，目标buffer的所有权要转移给使用它的队列族：
+// 每一批拷贝完在传输队列上release，渲染的时候用RecordAcquireBarriers在图形队列上acquire，并且等这一批的timeline值
+// 所有权转移之后没有写到的范围内容是未定义的，所以走传输队列的buffer应该整个上传(静态的顶点、索引数据)
+// 跨队列的时候timeline必须只给这一个队列用，不同队列signal同一个timeline的顺序是不确定的
+class StagingRing final {
+public:
+    static constexpr vk::DeviceSize DEFAULT_CAPACITY = 32ull * 1024 * 1024;
+
+    // queueFamilyIndex是执行拷贝的队列族，dstQueueFamilyIndex是之后使用这些buffer的队列族
+    void Init(vk::Device device, MemoryAllocator& allocator, GpuTimeline& timeline, vk::Queue queue, uint32_t queueFamilyIndex, uint32_t dstQueueFamilyIndex, vk::DeviceSize capacity = DEFAULT_CAPACITY) {
+        this->device = device;
+        this->allocator = &allocator;
+        this->timeline = &timeline;
+        this->queue = queue;
+        this->queueFamilyIndex = queueFamilyIndex;
+        this->dstQueueFamilyIndex = dstQueueFamilyIndex;
+        this->capacity = capacity;
+
+        auto bufferInfo = vk::BufferCreateInfo();
+        bufferInfo.setSize(capacity)
+                  .setUsage(vk::BufferUsageFlagBits::eTransferSrc)
+                  .setSharingMode(vk::SharingMode::eExclusive);
+        ring = allocator.CreateBuffer(bufferInfo, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+
+        // 命令缓冲区每一批都是录制一次就提交，所以用eTransient
+        auto poolInfo = vk::CommandPoolCreateInfo();
+        poolInfo.setQueueFamilyIndex(queueFamilyIndex)
+                .setFlags(vk::CommandPoolCreateFlagBits::eTransient | vk::CommandPoolCreateFlagBits::eResetCommandBuffer);
+        commandPool = device.createCommandPool(poolInfo);
+    }
+
+    void Destroy() {
+        WaitIdle();
+        freeBatches.clear();
+        device.destroyCommandPool(commandPool);
+        allocator->DestroyBuffer(ring);
+    }
+
+    // 把data拷贝到dst的dstOffset位置，超过环形缓冲区容量的数据会被拆成好几段
+    void Upload(vk::Buffer dst, vk::DeviceSize dstOffset, const void* data, vk::DeviceSize size) {
+        auto src = static_cast<const char*>(data);
+        uploadingBuffer = static_cast<VkBuffer>(dst);
+        while (size > 0) {
+            auto chunkSize = std::min(size, capacity / 2);
+            auto srcOffset = Reserve(chunkSize);
+            memcpy(static_cast<char*>(ring.allocation.mapped) + srcOffset, src, chunkSize);
+            pendingCopies[static_cast<VkBuffer>(dst)].push_back(vk::BufferCopy(srcOffset, dstOffset, chunkSize));
+            uploadedBytes += chunkSize;
+            src += chunkSize;
+            dstOffset += chunkSize;
+            size -= chunkSize;
+        }
+        uploadingBuffer = VK_NULL_HANDLE;
+    }
+
+    // 把攒起来的拷贝命令提交出去，不会等待GPU执行完
+    void Flush() {
+        if (pendingCopies.empty()) return;
+        auto batch = AcquireBatch();
+        auto beginInfo = vk::CommandBufferBeginInfo();
+        beginInfo.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+        batch.commandBuffer.begin(beginInfo);
+        // 同一个目标buffer的所有拷贝区域合并到一次copyBuffer里面
+        for (auto& [dst, regions] : pendingCopies) {
+            batch.commandBuffer.copyBuffer(ring.buffer, vk::Buffer(dst), regions);
+        }
+        batch.timelineValue = timeline->NextValue();
+        if (queueFamilyIndex == dstQueueFamilyIndex) {
+            // 之后同一个队列上的绘制命令要读这些数据，所以要保证拷贝写入对顶点/索引读取可见
+            auto barrier = vk::MemoryBarrier();
+            barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                   .setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+            batch.commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, {}, barrier, {}, {});
+        } else {
+            for (auto& [dst, regions] : pendingCopies) {
+                // Reserve在Upload中间触发的Flush，这个buffer后面还有拷贝要在传输队列上执行，等最后一段拷贝完的那一批再release
+                if (dst == uploadingBuffer) continue;
+                auto transfer = BufferOwnershipTransfer();
+                transfer.buffer = vk::Buffer(dst);
+                transfer.srcQueueFamilyIndex = queueFamilyIndex;
+                transfer.dstQueueFamilyIndex = dstQueueFamilyIndex;
+                transfer.srcStage = vk::PipelineStageFlagBits::eTransfer;
+                transfer.srcAccess = vk::AccessFlagBits::eTransferWrite;
+                transfer.dstStage = vk::PipelineStageFlagBits::eVertexInput;
+                transfer.dstAccess = vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead;
+                transfer.RecordRelease(batch.commandBuffer);
+                pendingAcquires.push_back(transfer);
+            }
+            acquireWaitValue = batch.timelineValue;
+        }
+        batch.commandBuffer.end();
+
+        auto timelineInfo = vk::TimelineSemaphoreSubmitInfo();
+        timelineInfo.setSignalSemaphoreValues(batch.timelineValue);
+        auto signalSemaphore = timeline->Get();
+        auto submitInfo = vk::SubmitInfo();
+        submitInfo.setCommandBuffers(batch.commandBuffer)
+                  .setSignalSemaphores(signalSemaphore)
+                  .setPNext(&timelineInfo);
+        queue.submit(submitInfo);
+
+        batch.ringEnd = writePos;
+        inFlightBatches.push_back(batch);
+        pendingCopies.clear();
+    }
+
+    // 每帧调用一次，回收已经执行完的批次，不会阻塞
+    void Poll() {
+        while (!inFlightBatches.empty() && timeline->IsCompleted(inFlightBatches.front().timelineValue)) {
+            RetireFront();
+        }
+    }
+
+    void WaitIdle() {
+        Flush();
+        while (!inFlightBatches.empty()) {
+            WaitFront();
+        }
+    }
+
+    // 在使用这些buffer的队列上录制acquire，只有跨队列族的时候才有东西要录制
+    // 返回true的时候这个command buffer的提交要等timeline到waitValue
+    bool RecordAcquireBarriers(vk::CommandBuffer commandBuffer, uint64_t& waitValue, const DeviceDispatch& dispatch) {
+        if (pendingAcquires.empty()) return false;
+        for (const auto& transfer : pendingAcquires) {
+            transfer.RecordAcquire(commandBuffer, dispatch);
+        }
+        pendingAcquires.clear();
+        waitValue = acquireWaitValue;
+        return true;
+    }
+
+    vk::DeviceSize UploadedBytes() const { return uploadedBytes; }
+
+private:
+    struct Batch final {
+        vk::CommandBuffer commandBuffer;
+        uint64_t timelineValue = 0; // GPU执行到这个值说明这一批拷贝完成了
+        uint64_t ringEnd = 0; // 这一批用到的环形缓冲区的结束位置
+    };
+
+    vk::Device device;
+    MemoryAllocator* allocator = nullptr;
+    GpuTimeline* timeline = nullptr;
+    vk::Queue queue;
+    uint32_t queueFamilyIndex = 0;
+    uint32_t dstQueueFamilyIndex = 0;
+    std::vector<BufferOwnershipTransfer> pendingAcquires; // 已经release但是还没有acquire的buffer
+    uint64_t acquireWaitValue = 0;
+    VkBuffer uploadingBuffer = VK_NULL_HANDLE; // 正在Upload的目标buffer，它的拷贝还没有全部录制完
+    vk::CommandPool commandPool;
+    AllocatedBuffer ring;
+    vk::DeviceSize capacity = 0;
+    // 写入和回收的位置都是单调递增的，对capacity取模之后才是真正的偏移
+    uint64_t writePos = 0;
+    uint64_t readPos = 0;
+    vk::DeviceSize uploadedBytes = 0;
+    std::map<VkBuffer, std::vector<vk::BufferCopy>> pendingCopies;
+    std::deque<Batch> inFlightBatches;
+    std::vector<Batch> freeBatches;
+
+    vk::DeviceSize Reserve(vk::DeviceSize size) {
+        // copyBuffer对偏移没有要求，这里按16字节对齐是为了memcpy快一点
+        writePos = (writePos + 15) & ~uint64_t(15);
+        auto offset = writePos % capacity;
+        if (offset + size > capacity) {
+            // 尾部放不下就直接跳到环形缓冲区的开头
+            writePos += capacity - offset;
+            offset = 0;
+        }
+        while (writePos + size - readPos > capacity) {
+            // 空间不够的时候先把自己攒着的提交掉，然后等最老的一批执行完
+            Flush();
+            if (inFlightBatches.empty()) break;
+            WaitFront();
+        }
+        writePos += size;
+        return offset;
+    }
+
+    Batch AcquireBatch() {
+        if (freeBatches.empty()) {
+            Poll();
+        }
+        if (!freeBatches.empty()) {
+            auto batch = freeBatches.back();
+            freeBatches.pop_back();
+            batch.commandBuffer.reset();
+            return batch;
+        }
+        Batch batch;
+        auto allocateInfo = vk::CommandBufferAllocateInfo();
+        allocateInfo.setCommandPool(commandPool)
+                    .setLevel(vk::CommandBufferLevel::ePrimary)
+                    .setCommandBufferCount(1);
+        batch.commandBuffer = device.allocateCommandBuffers(allocateInfo).front();
+        return batch;
+    }
+
+    void WaitFront() {
+        timeline->Wait(inFlightBatches.front().timelineValue);
+        RetireFront();
+    }
+
+    void RetireFront() {
+        auto batch = inFlightBatches.front();
+        inFlightBatches.pop_front();
+        readPos = batch.ringEnd;
+        freeBatches.push_back(batch);
+    }
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// 简单的线程池，提交任务之后返回一个future
+class ThreadPool final {
+public:
+    explicit ThreadPool(uint32_t threadCount = DefaultThreadCount()) {
+        threadCount = std::max(1u, threadCount);
+        for (uint32_t i = 0; i < threadCount; ++i) {
+            workers.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // 任务的参数是执行它的线程编号(0到Size()-1)，需要每个线程一份资源的时候可以用来索引
+    template<typename F>
+    auto Submit(F&& func) -> std::future<std::invoke_result_t<F, uint32_t>> {
+        using Result = std::invoke_result_t<F, uint32_t>;
+        auto task = std::make_shared<std::packaged_task<Result(uint32_t)>>(std::forward<F>(func));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace([task](uint32_t threadIndex) { (*task)(threadIndex); });
+        }
+        condition.notify_one();
+        return future;
+    }
+
+    uint32_t Size() const { return static_cast<uint32_t>(workers.size()); }
+
+    // 留一个核给主线程
+    static uint32_t DefaultThreadCount() {
+        auto count = std::thread::hardware_concurrency();
+        return count > 1 ? count - 1 : 1;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void(uint32_t)>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+    void WorkerLoop(uint32_t threadIndex) {
+        while (true) {
+            std::function<void(uint32_t)> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task(threadIndex);
+        }
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// 记录CPU和GPU的时间线，导出成chrome://tracing和Perfetto都能打开的JSON
+// 每个线程第一次记录的时候注册一个自己的事件缓冲区，之后只有这个线程往里面写，写完一个事件再用release更新数量，
+// 所以记录的时候不用加锁，导出的时候用acquire读数量，只读已经写完的事件
+// 缓冲区是固定大小的，写满之后的事件直接丢掉，不会在帧中间分配内存
+class Tracer final {
+public:
+    static constexpr size_t EVENTS_PER_THREAD = 1 << 16;
+
+    // 调用Enable(true)的线程会被当作主线程，编号是0
+    static void Enable(bool value) {
+        if (value) LocalBuffer();
+        enabled.store(value, std::memory_order_relaxed);
+    }
+
+    static bool Enabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // 所有的事件都用steady_clock的纳秒，GPU的时间戳要先换算到这个时钟上
+    static int64_t NowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // name必须是字符串常量，只保存指针
+    static void Record(const char* name, int64_t beginNs, int64_t endNs) {
+        if (!Enabled()) return;
+        Push(LocalBuffer(), { name, beginNs, endNs, false });
+    }
+
+    // GPU的事件单独放在一个进程里面显示，不管是哪个线程读出来的
+    static void RecordGpu(const char* name, int64_t beginNs, int64_t endNs) {
+        if (!Enabled()) return;
+        Push(LocalBuffer(), { name, beginNs, endNs, true });
+    }
+
+    // 可以在任何时候调用，其他线程同时在记录也没关系，只是不包含还没写完的事件
+    static bool WriteJson(const std::string& path) {
+        std::ofstream file(path);
+        if (!file.is_open()) return false;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        int64_t baseNs = INT64_MAX;
+        for (const auto& buffer : buffers) {
+            auto count = buffer->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; ++i) baseNs = std::min(baseNs, buffer->events[i].beginNs);
+        }
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"CPU\"}},\n";
+        file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"GPU\"}},\n";
+        file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":0,\"args\":{\"name\":\"Graphics queue\"}}";
+        file << std::fixed << std::setprecision(3);
+        for (const auto& buffer : buffers) {
+            file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+                 << ",\"args\":{\"name\":\"" << (buffer->threadId == 0 ? "Main" : "Worker " + std::to_string(buffer->threadId)) << "\"}}";
+            auto count = buffer->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; ++i) {
+                const auto& event = buffer->events[i];
+                file << ",\n{\"name\":\"" << Escape(event.name) << "\",\"ph\":\"X\""
+                     << ",\"ts\":" << (event.beginNs - baseNs) / 1000.0
+                     << ",\"dur\":" << (event.endNs - event.beginNs) / 1000.0
+                     << ",\"pid\":" << (event.gpu ? 2 : 1)
+                     << ",\"tid\":" << (event.gpu ? 0 : buffer->threadId) << "}";
+            }
+        }
+        file << "\n]}\n";
+        return true;
+    }
+
+private:
+    struct Event final {
+        const char* name;
+        int64_t beginNs;
+        int64_t endNs;
+        bool gpu;
+    };
+
+    struct ThreadBuffer final {
+        uint32_t threadId = 0;
+        std::unique_ptr<Event[]> events = std::make_unique<Event[]>(EVENTS_PER_THREAD);
+        std::atomic<size_t> count{ 0 };
+    };
+
+    static inline std::atomic<bool> enabled{ false };
+    static inline std::mutex registryMutex;
+    static inline std::vector<std::unique_ptr<ThreadBuffer>> buffers; // 线程退出之后也保留，导出的时候还要用
+
+    // 按第一次记录事件的顺序给线程编号
+    static ThreadBuffer& LocalBuffer() {
+        thread_local ThreadBuffer* buffer = [] {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            buffers.push_back(std::make_unique<ThreadBuffer>());
+            buffers.back()->threadId = static_cast<uint32_t>(buffers.size() - 1);
+            return buffers.back().get();
+        }();
+        return *buffer;
+    }
+
+    static void Push(ThreadBuffer& buffer, const Event& event) {
+        auto count = buffer.count.load(std::memory_order_relaxed);
+        if (count == EVENTS_PER_THREAD) return;
+        buffer.events[count] = event;
+        buffer.count.store(count + 1, std::memory_order_release);
+    }
+
+    static std::string Escape(const char* name) {
+        std::string result;
+        for (auto c = name; *c; ++c) {
+            if (*c == '"' || *c == '\\') result.push_back('\\');
+            result.push_back(*c);
+        }
+        return result;
+    }
+};
+
+// 作用域结束的时候记录一个CPU事件，没开启的时候只有一次原子读
+class TraceScope final {
+public:
+    explicit TraceScope(const char* name) : name(name), active(Tracer::Enabled()) {
+        if (active) beginNs = Tracer::NowNs();
+    }
+
+    ~TraceScope() {
+        if (active) Tracer::Record(name, beginNs, Tracer::NowNs());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name;
+    bool active;
+    int64_t beginNs = 0;
+};
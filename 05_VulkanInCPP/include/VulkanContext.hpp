@@ -1,14 +1,19 @@
+#ifdef _WIN32
 #define VK_USE_PLATFORM_WIN32_KHR
+#endif
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
+#ifdef _WIN32
 #define GLFW_EXPOSE_NATIVE_WIN32
 #include <GLFW/glfw3native.h>
+#endif
 
 #include <vulkan/vulkan.hpp>
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+const int MIN_DRAWS_PER_RECORD_TASK = 512; // 绘制数量太少的时候多线程录制反而更慢，每个任务至少录制这么多个draw
 
 #include <vector>
+#include <array>
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/vec4.hpp>
@@ -20,32 +25,178 @@ const int MAX_FRAMES_IN_FLIGHT = 2;
 #include <cstring>
 #include <optional>
 #include <set>
+#include <utility>
 #include <algorithm>
 #include <fstream>
 #include <filesystem>
 #include <semaphore>
+#include <chrono>
+#include <string>
+#include <future>
+#include <functional>
+#include <iomanip>
+#include <cmath>
+
+#include "MemoryAllocator.hpp"
+#include "StagingRing.hpp"
+#include "PipelineCache.hpp"
+#include "PipelineCompiler.hpp"
+#include "ThreadPool.hpp"
+#include "GpuTimeline.hpp"
+#include "FrameStats.hpp"
+#include "ReadbackRing.hpp"
+#include "GpuProfiler.hpp"
+#include "Tracer.hpp"
+#include "DeviceDispatch.hpp"
+#include "DeletionQueue.hpp"
+#include "PhysicalDeviceSelector.hpp"
+#include "RenderGraph.hpp"
+#include "MeshWelder.hpp"
+#include "MeshOptimizer.hpp"
+#include "MeshFile.hpp"
 
 class VulkanContext final {
+public:
+    // 运行时的配置，通过命令行参数传进来
+    struct Options final {
+        uint32_t recordThreads = 0; // 录制命令的工作线程数量，0表示按CPU核数自动选择
+        uint32_t recordBenchmarkDraws = 0; // 不为0的时候不进入主循环，而是测试录制这么多个draw在不同线程数下的耗时
+        uint32_t framesInFlight = 2; // CPU最多可以领先GPU几帧，越多吞吐越高，但是输入延迟也越大
+        uint32_t swapchainImages = 0; // 交换链的image数量，0表示用默认的2张(会被clamp到surface支持的范围)
+        uint32_t latencyTestFrames = 0; // 不为0的时候测试不同的帧数配置下的帧时间和输入延迟，每种配置跑这么多帧
+        uint32_t resizeBenchmarkFrames = 0; // 不为0的时候测试连续修改窗口大小时两种交换链过期处理方式的耗时
+        bool headless = false; // 不创建窗口和交换链，渲染到离屏的image上，用在没有显示器的机器上
+        uint32_t width = 800;
+        uint32_t height = 600;
+        uint32_t frameCount = 0; // 渲染这么多帧之后退出，0表示一直渲染到窗口关闭(无窗口模式下默认100帧)
+        uint32_t readbackInterval = 0; // 不为0的时候每隔这么多帧把渲染结果读回CPU，只在无窗口模式下生效
+        ReadbackRing::Callback readbackCallback; // 回读结果晚几帧在主线程交给这个回调，为空的时候保存成ppm文件
+        uint32_t gpuProfileInterval = 0; // 不为0的时候用timestamp测量GPU耗时，每隔这么多帧打印一次，退出时写到gpu_profile.txt
+        uint32_t traceFrames = 0; // 不为0的时候记录CPU和GPU的时间线，渲染这么多帧之后(或者退出的时候)写到trace.json
+        bool serialInit = false; // 按顺序一步一步初始化，用来和并行初始化对比启动时间
+        bool gpuProfile = false; // 用timestamp测量GPU耗时，--gpu-profile会打开它
+        vk::PresentModeKHR presentMode = vk::PresentModeKHR::eMailbox; // surface不支持的时候退回FIFO，FIFO是一定支持的
+        uint32_t triangleCount = 1; // 场景里面有多少个三角形，大于1的时候铺满整个屏幕
+        uint32_t drawCount = 1; // 三角形平均分到这么多个draw里面
+        uint32_t warmupFrames = 0; // 统计帧时间的时候跳过前面这么多帧
+        bool collectReport = false; // 记录每一帧的耗时，退出之前填好RunReport
+        bool directDispatch = true; // 录制和提交用vkGetDeviceProcAddr拿到的函数指针，不经过loader的跳转
+        uint32_t dispatchBenchmarkDraws = 0; // 不为0的时候测试经过loader和直接调用两种方式录制这么多个draw的耗时
+        std::string preferredDevice; // 优先使用的显卡，名字的一部分或者UUID，为空的时候按分数自动挑选
+        bool dedicatedQueues = true; // 有专用的传输/计算队列族的时候用它们，关掉之后所有的工作都在图形队列上
+        bool dynamicRendering = true; // 设备支持的时候用dynamic rendering，不创建render pass和framebuffer
+        bool optimizeMesh = true; // 加载的时候重排三角形和顶点，提高post-transform cache命中率
+        std::string meshPath; // MeshConverter生成的.vmesh文件，为空的时候用程序生成的三角形
+
+        static Options FromArgs(int argc, char** argv) {
+            Options options;
+            for (int i = 1; i + 1 < argc; i += 2) {
+                std::string name = argv[i];
+                if (name == "--gpu") { // 值不是数字的参数
+                    options.preferredDevice = argv[i + 1];
+                    continue;
+                }
+                if (name == "--mesh") {
+                    options.meshPath = argv[i + 1];
+                    continue;
+                }
+                auto value = static_cast<uint32_t>(std::stoul(argv[i + 1]));
+                if (name == "--record-threads") {
+                    options.recordThreads = value;
+                } else if (name == "--record-bench") {
+                    options.recordBenchmarkDraws = value;
+                } else if (name == "--frames-in-flight") {
+                    options.framesInFlight = std::max(1u, value);
+                } else if (name == "--swapchain-images") {
+                    options.swapchainImages = value;
+                } else if (name == "--latency-test") {
+                    options.latencyTestFrames = value;
+                } else if (name == "--resize-bench") {
+                    options.resizeBenchmarkFrames = value;
+                } else if (name == "--headless") {
+                    options.headless = value != 0;
+                } else if (name == "--width") {
+                    options.width = value;
+                } else if (name == "--height") {
+                    options.height = value;
+                } else if (name == "--frames") {
+                    options.frameCount = value;
+                } else if (name == "--readback") {
+                    options.readbackInterval = value;
+                } else if (name == "--gpu-profile") {
+                    options.gpuProfile = value > 0;
+                    options.gpuProfileInterval = value;
+                } else if (name == "--present-mode") {
+                    options.presentMode = static_cast<vk::PresentModeKHR>(value); // 0 immediate, 1 mailbox, 2 fifo, 3 fifo relaxed
+                } else if (name == "--triangles") {
+                    options.triangleCount = std::max(1u, value);
+                } else if (name == "--draws") {
+                    options.drawCount = std::max(1u, value);
+                } else if (name == "--trace") {
+                    options.traceFrames = value;
+                } else if (name == "--serial-init") {
+                    options.serialInit = value != 0;
+                } else if (name == "--direct-dispatch") {
+                    options.directDispatch = value != 0;
+                } else if (name == "--dedicated-queues") {
+                    options.dedicatedQueues = value != 0;
+                } else if (name == "--dynamic-rendering") {
+                    options.dynamicRendering = value != 0;
+                } else if (name == "--optimize-mesh") {
+                    options.optimizeMesh = value != 0;
+                } else if (name == "--dispatch-bench") {
+                    options.dispatchBenchmarkDraws = value;
+                } else {
+                    throw std::runtime_error("unknown option: " + name);
+                }
+            }
+            return options;
+        }
+    };
+
+    // 一次运行的统计结果，Options::collectReport打开的时候才会填
+    struct RunReport final {
+        uint32_t frames = 0; // 统计了多少帧，不包括预热的帧
+        double initMs = 0.0; // 从构造开始到Init结束
+        double firstFrameMs = 0.0; // 从构造开始到第一帧提交
+        FrameStats cpuFrameMs; // 每一帧CPU上的耗时(从poll事件到提交/显示完)
+        FrameStats frameIntervalMs; // 相邻两帧结束的间隔，也就是实际的帧时间
+        std::vector<GpuProfiler::ScopeStats> gpu; // 需要打开gpuProfile
+        MemoryAllocator::Stats memory; // 退出之前的显存分配情况
+    };
+
 private:
     static inline std::once_flag _init_flag;
     static inline std::unique_ptr<VulkanContext> _ins = nullptr;
+    static inline Options _options;
+    static inline std::once_flag _options_flag;
+    Options options; // 这个实例用的配置，单例用的是_options，性能测试每个场景都会用自己的配置创建一个实例
 
     #pragma region VulkanContext
 
     vk::Instance vkInstance;
     vk::PhysicalDevice physicalDevice;
     vk::Device device;
+    DeviceDispatch deviceDispatch; // 每一帧的录制、提交和显示都通过它调用，CreateLogicalDevice之后才能用
     struct QueueFamilyIndices final{
         std::optional<uint32_t> graphicsFamily; // 支持图像渲染的队列族索引
         std::optional<uint32_t> presentFamily; // 支持图像显示的队列族索引
+        std::optional<uint32_t> transferFamily; // 上传数据用的队列族，没有专用的时候就是图形队列族
+        std::optional<uint32_t> computeFamily; // 异步计算用的队列族，没有专用的时候就是图形队列族
         operator bool() const {
             return graphicsFamily.has_value() && presentFamily.has_value();
         }
     } familyIndices;
     vk::Queue graphicsQueue;
     vk::Queue presentQueue;
+    vk::Queue transferQueue; // 和graphicsQueue可能是同一个队列
+    vk::Queue computeQueue;
     vk::SurfaceKHR surface;
     vk::SwapchainKHR swapChain;
+    bool headless = false; // 无窗口模式下swapChainInfo.images是自己创建的离屏image，不是交换链的image
+    std::vector<AllocatedImage> offscreenImages;
+    bool swapChainOutOfDate = false; // 窗口最小化的时候没法创建交换链，等恢复之后再重建
+    uint32_t nextOffscreenImage = 0; // 离屏image轮流使用，相当于自己实现的acquireNextImage
     struct SwapChainInfo final{
         vk::SurfaceFormatKHR format;
         vk::PresentModeKHR presentMode;
@@ -55,20 +206,52 @@ private:
         uint32_t imageCount;
         vk::SurfaceCapabilitiesKHR capabilities;
     } swapChainInfo;
-    vk::RenderPass renderPass;
+    // 一帧的渲染由帧图描述，render pass、framebuffer和barrier都由它管理
+    RenderGraph renderGraph;
+    RenderGraph::Resource colorTarget = RenderGraph::INVALID; // 这一帧渲染到的交换链(或者离屏)image
+    RenderGraph::Pass mainPass = RenderGraph::INVALID;
+    RenderGraph::Pass readbackPass = RenderGraph::INVALID; // 只有回读打开的时候才有
+    uint32_t recordMaxTasks = 0; // 录制这一帧的时候传给main pass回调的参数
+    vk::RenderPass renderPass; // mainPass的render pass，归renderGraph所有，创建管线的时候用
     vk::PipelineLayout pipelineLayout;
-    vk::Pipeline graphicsPipeline;
-    std::vector<vk::Framebuffer> framebuffers;
-    vk::CommandPool commandPool;
-    std::vector<vk::CommandBuffer> commandBuffers;
+    PipelineHandle graphicsPipeline; // 异步编译，编译好之前绘制的时候会跳过
+    PipelineCache pipelineCache; // 所有的管线创建共用一个缓存
+    PipelineCompiler pipelineCompiler; // 在工作线程里面并行编译管线
+    // 每一帧自己的command pool，等这一帧的fence signaled之后整个pool一次性reset
+    // 比每个command buffer单独reset要快，而且pool不需要eResetCommandBuffer标志
+    struct FrameResources final {
+        std::vector<vk::CommandPool> commandPools; // 每个录制线程一个，pool是不能多线程同时使用的，0号给主线程，后面的给工作线程
+        vk::CommandBuffer commandBuffer; // 从commandPools[0]中分配的主command buffer
+        std::vector<std::vector<vk::CommandBuffer>> secondaryBuffers; // 每个pool分配出来的secondary command buffer，pool reset之后可以重复使用
+        std::vector<uint32_t> secondaryUsed; // 这一帧每个pool已经用掉了几个secondary command buffer
+    };
+    std::vector<FrameResources> frames;
+    std::unique_ptr<ThreadPool> recordPool; // 录制secondary command buffer的工作线程
 
     std::vector<vk::Semaphore> imageAvailableSemaphores;
     std::vector<vk::Semaphore> renderFinishedSemaphores;
-    std::vector<vk::Fence> inFlightFences;
+    GpuTimeline timeline; // GPU的进度，图形队列的提交都signal这个timeline semaphore
+    GpuTimeline uploadTimeline; // 暂存缓冲区的上传单独用一个，传输队列和图形队列signal的顺序是不确定的
+    uint64_t uploadWaitValue = 0; // 这一帧的提交要等uploadTimeline到这个值，0表示不用等
+    DeletionQueue deletionQueue; // 运行时要释放的对象都放这里，GPU用完之后再销毁
+    std::vector<uint64_t> frameTimelineValues; // 每一帧提交的时候signal的值，等到这个值就说明这一帧渲染完了
     uint32_t currentFrame = 0;
+    uint32_t framesInFlight = 2; // 运行时可以修改，所有每一帧的资源都按这个数量创建
+    uint32_t desiredImageCount = 0; // 0表示默认
     bool framebufferResized = false;
-    vk::Buffer vertexBuffer;
-    vk::DeviceMemory vertexBufferMemory;
+    bool useSwapchainExceptions = false; // 只有RunResizeBenchmark会打开，正常的帧循环里面不会抛异常
+    uint32_t swapchainRecreateCount = 0;
+    MemoryAllocator allocator; // 所有的buffer和image都从这里子分配显存
+    StagingRing stagingRing; // 上传数据到DEVICE_LOCAL显存
+    ReadbackRing readbackRing; // 把离屏渲染的结果读回CPU
+    bool readbackEnabled = false;
+    uint64_t frameNumber = 0; // 一共提交了多少帧，用来标记回读结果是哪一帧的
+    GpuProfiler gpuProfiler; // 没有Init的时候所有的调用都什么也不做
+    bool dynamicRendering = false; // 选项打开并且设备支持Vulkan 1.3的dynamicRendering
+    bool calibratedTimestamps = false; // 是否打开了VK_EXT_calibrated_timestamps，用来对齐CPU和GPU的时间线
+    AllocatedBuffer vertexBuffer;
+    AllocatedBuffer indexBuffer;
+    vk::IndexType indexType = vk::IndexType::eUint32; // 顶点少的时候用16位
 
     #pragma endregion
 
@@ -77,19 +260,48 @@ private:
         glm::vec2 pos;
         glm::vec3 color;
     };
-    // 前面是顶点位置,后面是顶点颜色
-    const std::vector<Vertex> vertices = {
+    // 前面是顶点位置,后面是顶点颜色，triangleCount大于1的时候在PrepareModelData里面重新生成
+    // PrepareModelData合并重复的顶点之后，这里只剩不重复的顶点，三角形由indices描述
+    std::vector<Vertex> vertices = {
         {{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
         {{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
         {{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}}
     };
+    std::vector<uint32_t> indices;
+    uint32_t vertexCount = 0; // 从文件加载的时候vertices和indices是空的，数量以这两个为准
+    uint32_t indexCount = 0;
+    std::optional<MeshFile> meshFile; // mmap的网格文件，上传到暂存缓冲区之后就解除映射
+    // 每个draw画索引缓冲区中的一段
+    struct DrawCommand final {
+        uint32_t indexCount;
+        uint32_t firstIndex;
+    };
+    std::vector<DrawCommand> drawCommands;
     #pragma endregion
 
     // 不将其默认值设置成nullptr会导致火箭运行失败！！！！
     GLFWwindow* window = nullptr;
+    bool closeRequested = false;
 
-    VulkanContext(int width = 800, int height = 600){
-        InitWindow(width, height);
+    // 启动耗时统计，并行初始化的时候不同的步骤在不同的线程上记录
+    struct InitTiming final {
+        const char* name;
+        double startMs; // 相对于构造函数开始的时间
+        double durationMs;
+    };
+    std::chrono::steady_clock::time_point startTime;
+    std::vector<InitTiming> initTimings;
+    std::mutex initTimingsMutex;
+    bool firstFrameReported = false;
+    RunReport report;
+
+    explicit VulkanContext(const Options& options) : options(options) {
+        startTime = std::chrono::steady_clock::now();
+        framesInFlight = options.framesInFlight;
+        desiredImageCount = options.swapchainImages;
+        headless = options.headless;
+        Tracer::Enable(options.traceFrames > 0);
+        if (!headless) InitWindow(options.width, options.height);
         MainLoop();
     }
     
@@ -98,7 +310,7 @@ private:
     VulkanContext& operator=(const VulkanContext&) = delete;
     
     static void CreateInstance(){
-        _ins.reset(new VulkanContext);
+        _ins.reset(new VulkanContext(_options));
     }
 
     void InitWindow(int width, int height){
@@ -112,57 +324,165 @@ private:
     
     void MainLoop(){
         Init();
-        while(!glfwWindowShouldClose(window)) {
-            glfwPollEvents();
+        if (options.recordBenchmarkDraws > 0) {
+            RunRecordBenchmark(options.recordBenchmarkDraws);
+            RequestClose();
+        }
+        if (options.dispatchBenchmarkDraws > 0) {
+            RunDispatchBenchmark(options.dispatchBenchmarkDraws);
+            RequestClose();
+        }
+        if (options.latencyTestFrames > 0) {
+            RunLatencyTest(options.latencyTestFrames);
+            RequestClose();
+        }
+        if (options.resizeBenchmarkFrames > 0) {
+            RunResizeBenchmark(options.resizeBenchmarkFrames);
+            RequestClose();
+        }
+        if (options.collectReport) graphicsPipeline.Wait(); // 测性能的时候不要把只清屏的帧算进去
+        auto frameCount = options.frameCount > 0 ? options.frameCount : (headless ? 100u : 0u);
+        auto lastFrameEnd = std::chrono::steady_clock::now();
+        for (uint32_t frame = 0; !ShouldClose() && (frameCount == 0 || frame < frameCount); ++frame) {
+            auto frameStart = std::chrono::steady_clock::now();
+            PollEvents();
             Update();
+            auto frameEnd = std::chrono::steady_clock::now();
+            if (options.collectReport && frame >= options.warmupFrames) {
+                report.cpuFrameMs.Add(std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+                report.frameIntervalMs.Add(std::chrono::duration<double, std::milli>(frameEnd - lastFrameEnd).count());
+            }
+            lastFrameEnd = frameEnd;
+        }
+        if (options.collectReport) {
+            device.waitIdle();
+            report.frames = static_cast<uint32_t>(report.cpuFrameMs.Count());
+            report.gpu = gpuProfiler.GetStats(); // 最后几帧的结果还没读回来，不过GPU耗时本来就是滚动统计
+            report.memory = allocator.GetStats();
         }
         Destroy();
     }
     
-    static std::vector<char> readFile(const std::string& filename) {
-        // ate表示从文件末尾打开文件
-        std::ifstream file(filename, std::ios::ate | std::ios::binary);
-        if (!file.is_open()) {
-            throw std::runtime_error("failed to open file!");
-        }
-        size_t fileSize = (size_t) file.tellg();
-        std::vector<char> buffer(fileSize);
-        file.seekg(0);
-        file.read(buffer.data(), fileSize);
-        file.close();
-        return buffer;
+    // 无窗口模式下没有glfw的窗口，这几个函数把两种模式的区别藏起来
+    bool ShouldClose() const {
+        return headless ? closeRequested : glfwWindowShouldClose(window);
     }
 
-    void Init(){
-        CreateVulkanInstance();
-
-        CreateSurface();
-
-        PickPhysicalDevice();
-
-        QueryQueueFamilyIndices();
-
-        CreateLogicalDevice();
-
-        GetQueues();
-
-        CreateSwapChain();
+    void RequestClose(){
+        closeRequested = true;
+        if (!headless) glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
 
-        CreateImageViews();
+    void PollEvents(){
+        if (!headless) glfwPollEvents();
+    }
 
-        CreateRenderPass();
+    // 初始化的一步，deps是必须先完成的步骤，这个列表本身就是按依赖排好序的
+    // mainThread的步骤要调用glfw的函数，只能在主线程执行
+    struct InitTask final {
+        const char* name;
+        void (VulkanContext::*step)();
+        std::vector<const char*> deps;
+        bool mainThread = false;
+    };
 
-        CreateGraphicsPipeline();
+    std::vector<InitTask> InitTasks(){
+        return {
+            { "PrepareModelData",        &VulkanContext::PrepareModelData,        {} },
+            { "CreateVulkanInstance",    &VulkanContext::CreateVulkanInstance,    {}, true },
+            { "CreateSurface",           &VulkanContext::CreateSurface,           { "CreateVulkanInstance" }, true },
+            { "PickPhysicalDevice",      &VulkanContext::PickPhysicalDevice,      { "CreateVulkanInstance", "CreateSurface" } },
+            { "QueryQueueFamilyIndices", &VulkanContext::QueryQueueFamilyIndices, { "PickPhysicalDevice", "CreateSurface" } },
+            { "CreateLogicalDevice",     &VulkanContext::CreateLogicalDevice,     { "QueryQueueFamilyIndices" } },
+            { "GetQueues",               &VulkanContext::GetQueues,               { "CreateLogicalDevice" } },
+            { "CreateAllocator",         &VulkanContext::CreateAllocator,         { "CreateLogicalDevice" } },
+            { "CreateTimeline",          &VulkanContext::CreateTimeline,          { "CreateLogicalDevice" } },
+            { "CreateDeletionQueue",     &VulkanContext::CreateDeletionQueue,     { "CreateAllocator", "CreateTimeline" } },
+            { "CreateGpuProfiler",       &VulkanContext::CreateGpuProfiler,       { "CreateLogicalDevice" } },
+            { "CreatePipelineCache",     &VulkanContext::CreatePipelineCache,     { "CreateLogicalDevice" } },
+            { "CreateCommandPool",       &VulkanContext::CreateCommandPool,       { "CreateLogicalDevice" } },
+            { "CreateSyncObjects",       &VulkanContext::CreateSyncObjects,       { "CreateLogicalDevice" } },
+            { "CreateSwapChain",         &VulkanContext::CreateSwapChain,         { "CreateAllocator" }, true },
+            { "CreateImageViews",        &VulkanContext::CreateImageViews,        { "CreateSwapChain" } },
+            { "CreateRenderGraph",       &VulkanContext::CreateRenderGraph,       { "CreateSwapChain" } },
+            { "CreateGraphicsPipeline",  &VulkanContext::CreateGraphicsPipeline,  { "CreateRenderGraph", "CreatePipelineCache" } },
+            { "CreateStagingRing",       &VulkanContext::CreateStagingRing,       { "CreateAllocator", "CreateTimeline", "GetQueues" } },
+            { "CreateReadbackRing",      &VulkanContext::CreateReadbackRing,      { "CreateAllocator", "CreateTimeline", "CreateSwapChain" } },
+            { "CreateVertexBuffers",     &VulkanContext::CreateVertexBuffers,     { "CreateStagingRing", "PrepareModelData" } },
+            { "CreateCommandBuffers",    &VulkanContext::CreateCommandBuffers,    { "CreateCommandPool" } },
+        };
+    }
 
-        CreateFramebuffers();
+    void Init(){
+        auto tasks = InitTasks();
+        if (options.serialInit) {
+            for (const auto& task : tasks) {
+                InitStep(task.name, task.step);
+            }
+        } else {
+            RunInitParallel(tasks);
+        }
+        PrintInitTimings();
+    }
 
-        CreateCommandPool();
+    // 没有依赖关系的步骤在线程池里面同时执行
+    // 任务按列表的顺序提交，每个任务只等排在它前面的任务，主线程也按列表的顺序执行自己的任务，所以不会死锁
+    void RunInitParallel(const std::vector<InitTask>& tasks){
+        std::vector<std::promise<void>> promises(tasks.size());
+        std::vector<std::shared_future<void>> done;
+        for (auto& promise : promises) {
+            done.push_back(promise.get_future().share());
+        }
+        auto run = [this, &tasks, &promises, &done](size_t index) {
+            try {
+                for (auto dep : tasks[index].deps) {
+                    auto it = std::find_if(tasks.begin(), tasks.end(), [dep](const InitTask& task) { return std::strcmp(task.name, dep) == 0; });
+                    done[it - tasks.begin()].get(); // 依赖的步骤抛了异常的话这里会重新抛出来
+                }
+                InitStep(tasks[index].name, tasks[index].step);
+                promises[index].set_value();
+            } catch (...) {
+                promises[index].set_exception(std::current_exception());
+            }
+        };
 
-        CreateVertexBuffers();
+        {
+            ThreadPool pool;
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                if (!tasks[i].mainThread) pool.Submit([&run, i](uint32_t) { run(i); });
+            }
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                if (tasks[i].mainThread) run(i);
+            }
+            for (auto& future : done) future.wait();
+        }
+        for (auto& future : done) future.get(); // 把第一个失败的步骤的异常抛出去
+    }
 
-        CreateCommandBuffers();
+    // 每一步初始化都记录耗时，也记录到时间线上，可以看到启动的时间花在哪里
+    void InitStep(const char* name, void (VulkanContext::*step)()){
+        TraceScope scope(name);
+        auto stepStart = std::chrono::steady_clock::now();
+        (this->*step)();
+        auto stepEnd = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(initTimingsMutex);
+        initTimings.push_back({ name, std::chrono::duration<double, std::milli>(stepStart - startTime).count(),
+                                std::chrono::duration<double, std::milli>(stepEnd - stepStart).count() });
+    }
 
-        CreateSyncObjects();
+    void PrintInitTimings(){
+        std::sort(initTimings.begin(), initTimings.end(), [](const InitTiming& a, const InitTiming& b) { return a.startMs < b.startMs; });
+        double totalMs = 0.0;
+        std::cout << "Init steps (" << (options.serialInit ? "serial" : "parallel") << "):" << std::endl;
+        for (const auto& timing : initTimings) {
+            std::cout << "  " << std::left << std::setw(24) << timing.name << std::right
+                      << " start " << std::fixed << std::setprecision(2) << std::setw(8) << timing.startMs
+                      << " ms  took " << std::setw(8) << timing.durationMs << " ms" << std::defaultfloat << std::endl;
+            totalMs += timing.durationMs;
+        }
+        auto elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        report.initMs = elapsedMs;
+        std::cout << "Init finished at " << elapsedMs << " ms (steps took " << totalMs << " ms in total)" << std::endl;
     }
 
     void Update(){
@@ -172,35 +492,56 @@ private:
     void Destroy(){
         device.waitIdle();
 
-        device.freeMemory(vertexBufferMemory);
+        stagingRing.Destroy();
 
-        device.destroyBuffer(vertexBuffer);
+        if (readbackEnabled) readbackRing.Destroy(); // 还没交给回调的结果在这里全部交出去
 
-        ClearSwapChain();
+        if (options.traceFrames > 0 && frameNumber < options.traceFrames) WriteTrace(); // 没跑到指定的帧数就退出了
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-            device.destroySemaphore(imageAvailableSemaphores[i]);
-            device.destroySemaphore(renderFinishedSemaphores[i]);
-            device.destroyFence(inFlightFences[i]);
+        if (gpuProfiler.Enabled() && options.gpuProfileInterval > 0) {
+            std::ofstream profileFile("gpu_profile.txt");
+            gpuProfiler.Dump(profileFile);
         }
+        gpuProfiler.Destroy();
+
+        allocator.DestroyBuffer(vertexBuffer);
 
-        device.destroyCommandPool(commandPool);
+        allocator.DestroyBuffer(indexBuffer);
 
-        device.destroyPipeline(graphicsPipeline);
+        renderGraph.Destroy(); // framebuffer引用了交换链的image view，要先销毁
+
+        ClearSwapChain();
+
+        deletionQueue.Destroy(); // 已经waitIdle了，剩下的全部销毁
+
+        DestroyFrameResources();
+
+        pipelineCompiler.WaitIdle(); // 还在编译的管线也要等它编译完，这样才能一起写进缓存
+
+        pipelineCache.Save(); // 退出的时候把这次运行编译出来的管线写回磁盘
+
+        pipelineCompiler.Destroy(); // 编译出来的管线都由编译服务负责销毁
+
+        pipelineCache.Destroy();
 
         device.destroyPipelineLayout(pipelineLayout);
 
-        device.destroyRenderPass(renderPass);
+        allocator.Destroy();
+
+        timeline.Destroy();
+
+        uploadTimeline.Destroy();
 
         device.destroy();
 
-        vkInstance.destroySurfaceKHR(surface);
+        if (!headless) vkInstance.destroySurfaceKHR(surface);
 
         vkInstance.destroy();
 
-        glfwDestroyWindow(window);
-
-        glfwTerminate();
+        if (!headless) {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
     }
 
     void CreateVulkanInstance(){
@@ -212,73 +553,152 @@ private:
         insCreateInfo.setPApplicationInfo(&appInfo);
 
         #pragma region 启用验证层
-        std::vector<const char*> layers = { "VK_LAYER_KHRONOS_validation" };
-        insCreateInfo.setEnabledLayerCount(1);
+        // 渲染节点上一般没有装Vulkan SDK，没有验证层的时候就不开，不然创建instance会失败
+        std::vector<const char*> layers;
+        for (const auto& layer : vk::enumerateInstanceLayerProperties()) {
+            if (std::strcmp(layer.layerName, "VK_LAYER_KHRONOS_validation") == 0) {
+                layers.push_back("VK_LAYER_KHRONOS_validation");
+            }
+        }
         insCreateInfo.setPEnabledLayerNames(layers);
         #pragma endregion
 
         #pragma region 启用扩展
+        // 无窗口模式下不需要surface相关的扩展
         std::vector<const char*> extensions = {};
-        uint32_t extCount;
-        auto exts = glfwGetRequiredInstanceExtensions(&extCount);
-        for (uint32_t i = 0; i < extCount; ++i) {
-            extensions.push_back(exts[i]);
-            std::cout << "Loaded extension: " << exts[i] << std::endl;
+        if (!headless) {
+            uint32_t extCount;
+            auto exts = glfwGetRequiredInstanceExtensions(&extCount);
+            for (uint32_t i = 0; i < extCount; ++i) {
+                extensions.push_back(exts[i]);
+                std::cout << "Loaded extension: " << exts[i] << std::endl;
+            }
         }
-        insCreateInfo.setEnabledExtensionCount(extCount).setPEnabledExtensionNames(extensions);
+        insCreateInfo.setPEnabledExtensionNames(extensions);
         #pragma endregion
 
         vkInstance = vk::createInstance(insCreateInfo);
     }
     
     void PickPhysicalDevice(){
-        // 这里可以写你想实现的挑选规则，能根据显卡支持的功能来设置优先级，然后根据优先级来挑选显卡设备
-        physicalDevice = vkInstance.enumeratePhysicalDevices().front();
-        std::cout << "Picked physical device: " << physicalDevice.getProperties().deviceName << std::endl;
+        // 多显卡的机器上第一个经常是集成显卡或者软件实现，按显卡支持的功能打分挑选
+        auto requirements = PhysicalDeviceSelector::Requirements();
+        requirements.apiVersion = VK_API_VERSION_1_2;
+        if (!headless) {
+            requirements.requiredExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+            requirements.surface = surface;
+        }
+        requirements.optionalExtensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+        requirements.preferred = options.preferredDevice;
+        physicalDevice = PhysicalDeviceSelector::Pick(vkInstance, requirements, std::cout);
     }
 
     void QueryQueueFamilyIndices(){
         auto properties = physicalDevice.getQueueFamilyProperties();
-        for (size_t i = 0; i < properties.size(); ++i)
+        auto supportsPresent = [this](uint32_t i) { return headless || physicalDevice.getSurfaceSupportKHR(i, surface); };
+        // 优先找同时支持渲染和显示的队列族，这样交换链的image不需要在两个队列之间共享
+        for (uint32_t i = 0; i < properties.size(); ++i)
         {
-            if(properties[i].queueFlags & vk::QueueFlagBits::eGraphics){
+            if ((properties[i].queueFlags & vk::QueueFlagBits::eGraphics) && supportsPresent(i)) {
                 familyIndices.graphicsFamily = i;
-            }
-            if(physicalDevice.getSurfaceSupportKHR(i, surface)){
                 familyIndices.presentFamily = i;
+                break;
             }
-            if(familyIndices) break;
         }
-        
+        for (uint32_t i = 0; i < properties.size() && !familyIndices; ++i)
+        {
+            if (!familyIndices.graphicsFamily && (properties[i].queueFlags & vk::QueueFlagBits::eGraphics)) familyIndices.graphicsFamily = i;
+            if (!familyIndices.presentFamily && supportsPresent(i)) familyIndices.presentFamily = i;
+        }
+        if (!familyIndices) throw std::runtime_error("failed to find graphics and present queue families!");
+
+        // 专用的传输队列族一般对应独显上的DMA引擎，只支持transfer；没有的话退而求其次用不带图形的计算队列族
+        // 专用的计算队列族不支持图形，计算可以和渲染同时进行
+        // 都没有的时候用图形队列族，图形队列一定支持transfer和compute
+        std::optional<uint32_t> transferOnly, computeTransfer, computeOnly;
+        for (uint32_t i = 0; i < properties.size() && options.dedicatedQueues; ++i)
+        {
+            auto flags = properties[i].queueFlags;
+            if (flags & vk::QueueFlagBits::eGraphics) continue;
+            if ((flags & vk::QueueFlagBits::eCompute) && !computeOnly) computeOnly = i;
+            if ((flags & vk::QueueFlagBits::eTransfer) && !(flags & vk::QueueFlagBits::eCompute) && !transferOnly) transferOnly = i;
+            if ((flags & vk::QueueFlagBits::eTransfer) && (flags & vk::QueueFlagBits::eCompute) && !computeTransfer) computeTransfer = i;
+        }
+        familyIndices.transferFamily = transferOnly ? transferOnly : computeTransfer ? computeTransfer : familyIndices.graphicsFamily;
+        familyIndices.computeFamily = computeOnly ? computeOnly : familyIndices.graphicsFamily;
+        std::cout << "Queue families: graphics " << familyIndices.graphicsFamily.value() << ", present " << familyIndices.presentFamily.value()
+                  << ", transfer " << familyIndices.transferFamily.value() << ", compute " << familyIndices.computeFamily.value() << std::endl;
     }
 
     void CreateLogicalDevice(){
         auto deviceCreateInfo = vk::DeviceCreateInfo();
 
         std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos;
-        std::set<uint32_t> uniqueQueueFamilies = {familyIndices.graphicsFamily.value(), familyIndices.presentFamily.value()};
+        std::set<uint32_t> uniqueQueueFamilies = {familyIndices.graphicsFamily.value(), familyIndices.presentFamily.value(),
+                                                  familyIndices.transferFamily.value(), familyIndices.computeFamily.value()};
         float priority = 1.0f;
         for (uint32_t queueFamily : uniqueQueueFamilies) {
             auto queueCreateInfo = vk::DeviceQueueCreateInfo();
             queueCreateInfo.setPQueuePriorities(&priority)
                           .setQueueCount(1)
-                          .setQueueFamilyIndex(familyIndices.graphicsFamily.value());
+                          .setQueueFamilyIndex(queueFamily);
             queueCreateInfos.push_back(queueCreateInfo);
         }
 
-        std::vector<const char*> exts = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+        std::vector<const char*> exts;
+        if (!headless) exts.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+        if (options.traceFrames > 0) {
+            for (const auto& ext : physicalDevice.enumerateDeviceExtensionProperties()) {
+                if (std::strcmp(ext.extensionName, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) == 0) {
+                    exts.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+                    calibratedTimestamps = true;
+                }
+            }
+        }
         
-        deviceCreateInfo.setQueueCreateInfos(queueCreateInfos).setPEnabledExtensionNames(exts);
+        // timeline semaphore是1.2的核心功能，但是还是要手动打开
+        auto vulkan12Features = vk::PhysicalDeviceVulkan12Features();
+        vulkan12Features.setTimelineSemaphore(true);
+        // dynamic rendering是1.3的核心功能，挑选设备的时候只要求1.2，所以不支持的时候退回render pass
+        auto vulkan13Features = vk::PhysicalDeviceVulkan13Features();
+        if (options.dynamicRendering && physicalDevice.getProperties().apiVersion >= VK_API_VERSION_1_3) {
+            auto supported = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceVulkan13Features>();
+            dynamicRendering = supported.get<vk::PhysicalDeviceVulkan13Features>().dynamicRendering;
+        }
+        if (dynamicRendering) {
+            vulkan13Features.setDynamicRendering(true);
+            vulkan12Features.setPNext(&vulkan13Features);
+        }
+        std::cout << "Rendering path: " << (dynamicRendering ? "dynamic rendering" : "render pass") << std::endl;
+
+        deviceCreateInfo.setQueueCreateInfos(queueCreateInfos).setPEnabledExtensionNames(exts).setPNext(&vulkan12Features);
 
         device = physicalDevice.createDevice(deviceCreateInfo);
+        deviceDispatch.Init(device, options.directDispatch); // 设备创建好之后只加载一次
     }
 
     void GetQueues(){
         graphicsQueue = device.getQueue(familyIndices.graphicsFamily.value(), 0);
         presentQueue = device.getQueue(familyIndices.presentFamily.value(), 0);
+        transferQueue = device.getQueue(familyIndices.transferFamily.value(), 0);
+        computeQueue = device.getQueue(familyIndices.computeFamily.value(), 0);
+    }
+
+    void CreateAllocator(){
+        allocator.Init(physicalDevice, device);
+    }
+
+    void CreateTimeline(){
+        timeline.Init(device);
+        uploadTimeline.Init(device);
+    }
+
+    void CreateDeletionQueue(){
+        deletionQueue.Init(device, allocator, timeline);
     }
 
     void CreateSurface(){
+        if (headless) return;
         VkSurfaceKHR s;
         if (glfwCreateWindowSurface(static_cast<VkInstance>(vkInstance), window, nullptr, &s) != VK_SUCCESS) {
             throw std::runtime_error("failed to create window surface!");
@@ -288,6 +708,10 @@ private:
 
     void CreateSwapChain(){
         QuerySwapChainInfo();
+        if (headless) {
+            CreateOffscreenImages();
+            return;
+        }
 
         auto createInfo = vk::SwapchainCreateInfoKHR();
         createInfo.setSurface(surface)
@@ -300,9 +724,9 @@ private:
                   .setImageExtent(swapChainInfo.extent)
                   .setImageFormat(swapChainInfo.format.format);
 
-        std::vector<unsigned int> queueFamilyIndices = { familyIndices.graphicsFamily.value(), familyIndices.graphicsFamily.value()};
+        std::vector<unsigned int> queueFamilyIndices = { familyIndices.graphicsFamily.value(), familyIndices.presentFamily.value()};
 
-        if (familyIndices.graphicsFamily.value() != familyIndices.graphicsFamily.value()) {
+        if (familyIndices.graphicsFamily.value() != familyIndices.presentFamily.value()) {
             createInfo.setImageSharingMode(vk::SharingMode::eConcurrent)
                       .setQueueFamilyIndexCount(queueFamilyIndices.size())
                       .setPQueueFamilyIndices(queueFamilyIndices.data());
@@ -314,7 +738,7 @@ private:
         createInfo.setPreTransform(swapChainInfo.capabilities.currentTransform)
                   .setCompositeAlpha(vk::CompositeAlphaFlagBitsKHR::eOpaque)
                   .setPresentMode(swapChainInfo.presentMode)
-                  .setOldSwapchain(nullptr);
+                  .setOldSwapchain(swapChain); // 重建的时候把旧的交换链传进去，驱动可以复用它的资源，旧交换链已经获取的image还能正常显示
 
         swapChain = device.createSwapchainKHR(createInfo);
 
@@ -322,7 +746,36 @@ private:
         swapChainInfo.imageViews.resize(swapChainInfo.images.size());
     }
 
+    // 无窗口模式下自己创建一组image来代替交换链的image，渲染完之后可以拷贝出来
+    void CreateOffscreenImages(){
+        auto createInfo = vk::ImageCreateInfo();
+        createInfo.setImageType(vk::ImageType::e2D)
+                  .setFormat(swapChainInfo.format.format)
+                  .setExtent({ swapChainInfo.extent.width, swapChainInfo.extent.height, 1 })
+                  .setMipLevels(1)
+                  .setArrayLayers(1)
+                  .setSamples(vk::SampleCountFlagBits::e1)
+                  .setTiling(vk::ImageTiling::eOptimal)
+                  .setUsage(vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc)
+                  .setSharingMode(vk::SharingMode::eExclusive)
+                  .setInitialLayout(vk::ImageLayout::eUndefined);
+        offscreenImages.resize(swapChainInfo.imageCount);
+        swapChainInfo.images.resize(swapChainInfo.imageCount);
+        for (uint32_t i = 0; i < swapChainInfo.imageCount; ++i) {
+            offscreenImages[i] = allocator.CreateImage(createInfo, vk::MemoryPropertyFlagBits::eDeviceLocal);
+            swapChainInfo.images[i] = offscreenImages[i].image;
+        }
+        swapChainInfo.imageViews.resize(swapChainInfo.images.size());
+        nextOffscreenImage = 0;
+    }
+
     void QuerySwapChainInfo(){
+        if (headless) {
+            swapChainInfo.format = vk::SurfaceFormatKHR(vk::Format::eR8G8B8A8Srgb, vk::ColorSpaceKHR::eSrgbNonlinear);
+            swapChainInfo.extent = vk::Extent2D(options.width, options.height);
+            swapChainInfo.imageCount = desiredImageCount > 0 ? desiredImageCount : 2;
+            return;
+        }
         for (const auto& availableFormat : physicalDevice.getSurfaceFormatsKHR(surface))
         {
             if (availableFormat.format == vk::Format::eR8G8B8A8Srgb && availableFormat.colorSpace == vk::ColorSpaceKHR::eSrgbNonlinear) {
@@ -331,15 +784,18 @@ private:
             }
         }
 
+        swapChainInfo.presentMode = vk::PresentModeKHR::eFifo;
         for (const auto& presentMode : physicalDevice.getSurfacePresentModesKHR(surface))
         {
-            if (presentMode == vk::PresentModeKHR::eMailbox) {
+            if (presentMode == options.presentMode) {
                 swapChainInfo.presentMode = presentMode;
             }
         }
 
         auto capabilities = physicalDevice.getSurfaceCapabilitiesKHR(surface);
-        swapChainInfo.imageCount = std::clamp<uint32_t>(2, capabilities.minImageCount, capabilities.maxImageCount);
+        // maxImageCount为0表示没有上限
+        auto maxImageCount = capabilities.maxImageCount > 0 ? capabilities.maxImageCount : std::numeric_limits<uint32_t>::max();
+        swapChainInfo.imageCount = std::clamp<uint32_t>(desiredImageCount > 0 ? desiredImageCount : 2, capabilities.minImageCount, maxImageCount);
         
         if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
             swapChainInfo.extent = capabilities.currentExtent;
@@ -372,77 +828,54 @@ private:
         }
     }
 
-    void CreateRenderPass(){
-        auto createInfo = vk::RenderPassCreateInfo();
-
-        // 设置颜色附件
-        auto colorAttachment = vk::AttachmentDescription();
-        colorAttachment.setFormat(swapChainInfo.format.format)
-                       .setSamples(vk::SampleCountFlagBits::e1)
-                       .setLoadOp(vk::AttachmentLoadOp::eClear)
-                       .setStoreOp(vk::AttachmentStoreOp::eStore)
-                       .setInitialLayout(vk::ImageLayout::eUndefined)
-                       .setFinalLayout(vk::ImageLayout::ePresentSrcKHR) // 这个layout表示是用来在swapchain中渲染到屏幕的Image
-                       .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
-                       .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare);
-
-        auto colorAttachmentRef = vk::AttachmentReference();
-        colorAttachmentRef.setAttachment(0)
-                          .setLayout(vk::ImageLayout::eColorAttachmentOptimal);
-
-        
-        auto subpass = vk::SubpassDescription();
-        subpass.setPipelineBindPoint(vk::PipelineBindPoint::eGraphics)
-               .setColorAttachments(colorAttachmentRef);
-
-        
-        auto subpassDependency = vk::SubpassDependency();
-        subpassDependency.setSrcSubpass(VK_SUBPASS_EXTERNAL)
-                         .setDstSubpass(0)
-                         .setSrcStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
-                         .setDstStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
-                         .setSrcAccessMask(vk::AccessFlags(0))
-                         .setDstAccessMask(vk::AccessFlagBits::eColorAttachmentWrite);
-
-        createInfo.setDependencies(subpassDependency)
-                  .setAttachments(colorAttachment)
-                  .setSubpasses(subpass);
+    // 交换链的image每一帧都是新acquire的，不需要之前的内容，acquire的semaphore在COLOR_ATTACHMENT_OUTPUT阶段等待
+    // 无窗口模式下离屏image可能还在被之前的帧回读，所以还要等TRANSFER阶段
+    // 以后加深度、阴影、后处理的pass只需要在这里声明它们读写什么，临时的attachment会自动共用显存
+    void CreateRenderGraph(){
+        renderGraph.Init(device, allocator, deviceDispatch, dynamicRendering);
+        auto initialStages = vk::PipelineStageFlags(vk::PipelineStageFlagBits::eColorAttachmentOutput);
+        if (headless) initialStages |= vk::PipelineStageFlagBits::eTransfer;
+        colorTarget = renderGraph.ImportImage("swapchain", swapChainInfo.format.format,
+                                              headless ? vk::ImageLayout::eUndefined : vk::ImageLayout::ePresentSrcKHR, initialStages);
+        renderGraph.MarkOutput(colorTarget);
+
+        mainPass = renderGraph.AddPass("main", [this](RenderGraph::PassContext& context) { RecordMainPass(context); });
+        renderGraph.WriteColor(mainPass, colorTarget, vk::ClearColorValue(std::array<float, 4>{ 82.0f / 255.0f, 82.0f / 255.0f, 136.0f / 255.0f, 1.0f }));
+
+        // 回读的拷贝放在这一帧的最后，和渲染一起提交，不需要额外的提交和等待
+        if (headless && options.readbackInterval > 0) {
+            readbackPass = renderGraph.AddPass("readback", [this](RenderGraph::PassContext& context) {
+                auto readbackScope = gpuProfiler.BeginScope(context.commandBuffer, "readback");
+                readbackRing.Record(context.commandBuffer, context.GetImage(colorTarget), swapChainInfo.format.format, swapChainInfo.extent, frameNumber);
+                gpuProfiler.EndScope(context.commandBuffer, readbackScope);
+            });
+            renderGraph.Read(readbackPass, colorTarget, RenderGraph::Usage::eTransferSrc);
+            renderGraph.SetSideEffect(readbackPass);
+        }
 
-        renderPass = device.createRenderPass(createInfo);
+        renderGraph.Compile(swapChainInfo.extent);
+        renderGraph.Print(std::cout);
+        renderPass = renderGraph.GetRenderPass(mainPass); // 管线只需要一个兼容的render pass，dynamic rendering的时候是空的
     }
 
-    vk::ShaderModule CreateShaderModule(const std::vector<char>& code){
-        vk::ShaderModuleCreateInfo createInfo;
-        createInfo.setCodeSize(code.size())
-                  .setPCode(reinterpret_cast<const uint32_t*>(code.data()));
-        return std::move(device.createShaderModule(createInfo));
+    void CreatePipelineCache(){
+        pipelineCache.Init(physicalDevice, device);
+        pipelineCompiler.Init(device, pipelineCache.Get());
     }
-    
+
+    // 这里只描述管线，真正的编译在pipelineCompiler的工作线程里面做，Init不会被管线编译卡住
     void CreateGraphicsPipeline(){
-        auto vertShaderCode = readFile("../assets/shader/vert.spv");
-        auto fragShaderCode = readFile("../assets/shader/frag.spv");
-        auto vertShaderModule = CreateShaderModule(vertShaderCode);
-        auto fragShaderModule = CreateShaderModule(fragShaderCode);
-        auto vertShaderStageInfo = vk::PipelineShaderStageCreateInfo();
-        vertShaderStageInfo.setStage(vk::ShaderStageFlagBits::eVertex)
-                        .setModule(vertShaderModule)
-                        .setPName("main");
-        auto fragShaderStageInfo = vk::PipelineShaderStageCreateInfo();
-        fragShaderStageInfo.setStage(vk::ShaderStageFlagBits::eFragment)
-                        .setModule(fragShaderModule)
-                        .setPName("main");
-        auto shaderStageInfos = std::vector<vk::PipelineShaderStageCreateInfo>{vertShaderStageInfo, fragShaderStageInfo};
-
-        // 渲染管线中可以动态修改的数据
-        std::vector<vk::DynamicState> dynamicStates = {vk::DynamicState::eViewport, vk::DynamicState::eScissor};
-        vk::PipelineDynamicStateCreateInfo dynamicStateCreateInfo;
-        dynamicStateCreateInfo.setDynamicStates(dynamicStates);
+        auto desc = GraphicsPipelineDesc();
+        desc.name = "triangle";
+        desc.vertexShaderPath = "../assets/shader/vert.spv";
+        desc.fragmentShaderPath = "../assets/shader/frag.spv";
 
         // 这里应该对应OpenGL中的vao
         auto vertexBingdingDes = vk::VertexInputBindingDescription();
         vertexBingdingDes.setBinding(0) // 接收的vbo的数量,这里只会接受一个vbo,设置是指定vbo的索引
                          .setStride(sizeof(Vertex)) // 设置一个数据的步长
                          .setInputRate(vk::VertexInputRate::eVertex); // 移动的行为,每个顶点移动一个步长,还是每个实例移动一个步长
+        desc.bindings = { vertexBingdingDes };
 
         auto posAttr = vk::VertexInputAttributeDescription();
         posAttr.setBinding(0) // 指定vulkan从哪个binding中获取数据,类似于OpenGL中的vbo id
@@ -454,78 +887,7 @@ private:
                  .setLocation(1)
                  .setFormat(vk::Format::eR32G32B32Sfloat)
                  .setOffset(offsetof(Vertex, color));
-
-        std::vector<vk::VertexInputAttributeDescription> vertexAttributeDes = { posAttr, colorAttr };
-
-        auto vertexInputInfo = vk::PipelineVertexInputStateCreateInfo();
-        vertexInputInfo.setVertexBindingDescriptionCount(1)
-                       .setVertexAttributeDescriptionCount(vertexAttributeDes.size())
-                       .setVertexBindingDescriptions({vertexBingdingDes})
-                       .setVertexAttributeDescriptions(vertexAttributeDes);
-
-        // 设置图元装配行为，对应OpenGL中的glDraw方法的一部分逻辑
-        auto inputAssemblyInfo = vk::PipelineInputAssemblyStateCreateInfo();
-        inputAssemblyInfo.setTopology(vk::PrimitiveTopology::eTriangleList)
-                         .setPrimitiveRestartEnable(false);
-
-        auto viewport = vk::Viewport();
-        viewport.setX(0.0f)
-                .setY(0.0f)
-                .setWidth(static_cast<float>(swapChainInfo.extent.width))
-                .setHeight(static_cast<float>(swapChainInfo.extent.height))
-                .setMinDepth(0.0f)
-                .setMaxDepth(1.0f);
-
-        auto scissor = vk::Rect2D();
-        scissor.setOffset({0, 0})
-               .setExtent(swapChainInfo.extent);
-
-        // 不要设置实际的数据，因为这些是动态修改的数据
-        auto viewportInfo = vk::PipelineViewportStateCreateInfo();
-        viewportInfo.setViewportCount(1)
-                    .setScissorCount(1);
-        
-        // 光栅化行为
-        auto rasterizationInfo = vk::PipelineRasterizationStateCreateInfo();
-        rasterizationInfo.setDepthClampEnable(false) // 设置为true会导致不在视锥范围内的像素会被clamp到视锥的范围内，这种情况适合shadow map
-                         .setRasterizerDiscardEnable(false) // 文档写的很模糊，这个设置为true就会导致不会光栅化
-                         .setPolygonMode(vk::PolygonMode::eFill) // 线框模式，填充模式，点模式
-                         .setCullMode(vk::CullModeFlagBits::eBack) // 剔除模式
-                         .setFrontFace(vk::FrontFace::eClockwise) // 设置前面的点顺序
-                         .setDepthBiasEnable(false) // 偏移深度，用来解决shadow map出现摩尔纹的问题，是因为采样的频率跟不上导致会产生这些问题
-                         .setLineWidth(1.0f); // 线宽
-
-        // 采样行为
-        auto multiSampleInfo = vk::PipelineMultisampleStateCreateInfo();
-        multiSampleInfo.setRasterizationSamples(vk::SampleCountFlagBits::e1)
-                       .setSampleShadingEnable(false)
-                       .setMinSampleShading(1.0f)
-                       .setPSampleMask(nullptr)
-                       .setAlphaToCoverageEnable(false)
-                       .setAlphaToOneEnable(false);
-
-
-        // 深度测试和模板测试的设置
-        auto depthStencilInfo = vk::PipelineDepthStencilStateCreateInfo();
-
-        // 颜色混合行为
-        auto colorBlendAttachment = vk::PipelineColorBlendAttachmentState();
-        colorBlendAttachment.setColorWriteMask(vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA)
-                             .setBlendEnable(false) // 这里没有启用混合，所以后面的参数可以不用设置，但是启用了混合之后就一定要根据需求来配置参数
-                             .setSrcColorBlendFactor(vk::BlendFactor::eZero)
-                             .setDstColorBlendFactor(vk::BlendFactor::eZero)
-                             .setColorBlendOp(vk::BlendOp::eAdd)
-                             .setSrcAlphaBlendFactor(vk::BlendFactor::eZero)
-                             .setDstAlphaBlendFactor(vk::BlendFactor::eZero)
-                             .setAlphaBlendOp(vk::BlendOp::eAdd);
-
-        
-        // 好像是另外一种按位颜色混合的方式，文档讲的不是很清楚
-        auto colorBlendInfo = vk::PipelineColorBlendStateCreateInfo();
-        colorBlendInfo.setLogicOpEnable(false)
-                      .setAttachments(colorBlendAttachment)
-                      .setLogicOp(vk::LogicOp::eCopy)
-                      .setBlendConstants({0.0f, 0.0f, 0.0f, 0.0f});
+        desc.attributes = { posAttr, colorAttr };
 
         // 通过这个结构来将uniform变量传递给shader
         auto pipelineLayoutCreateInfo = vk::PipelineLayoutCreateInfo();
@@ -536,77 +898,103 @@ private:
 
         pipelineLayout = device.createPipelineLayout(pipelineLayoutCreateInfo);
 
-        auto pipelineCreateInfo = vk::GraphicsPipelineCreateInfo();
-        pipelineCreateInfo.setStages(shaderStageInfos)
-                          .setPVertexInputState(&vertexInputInfo)
-                          .setPInputAssemblyState(&inputAssemblyInfo)
-                          .setPViewportState(&viewportInfo)
-                          .setPRasterizationState(&rasterizationInfo)
-                          .setPMultisampleState(&multiSampleInfo)
-                          .setPDepthStencilState(&depthStencilInfo)
-                          .setPColorBlendState(&colorBlendInfo)
-                          .setPDynamicState(&dynamicStateCreateInfo)
-                          .setLayout(pipelineLayout)
-                          .setRenderPass(renderPass)
-                          .setSubpass(0)
-                          .setBasePipelineHandle(nullptr)
-                          .setBasePipelineIndex(-1);
-
-        auto pipelineDetail = device.createGraphicsPipeline(nullptr, pipelineCreateInfo);
-        if (pipelineDetail.result != vk::Result::eSuccess) {
-            throw std::runtime_error("failed to create graphics pipeline!");
-        }
-        graphicsPipeline = pipelineDetail.value;
-
-        device.destroyShaderModule(vertShaderModule);
-        device.destroyShaderModule(fragShaderModule);
-    }
-
-    void CreateFramebuffers(){
-        framebuffers.resize(swapChainInfo.imageViews.size());
-        for (size_t i = 0; i < swapChainInfo.imageViews.size(); ++i)
-        {
-            auto attachments = std::vector<vk::ImageView>{swapChainInfo.imageViews[i]};
-            auto createInfo = vk::FramebufferCreateInfo();
-            createInfo.setRenderPass(renderPass)
-                      .setAttachments(attachments)
-                      .setWidth(swapChainInfo.extent.width)
-                      .setHeight(swapChainInfo.extent.height)
-                      .setLayers(1);
-            framebuffers[i] = device.createFramebuffer(createInfo);
-        }
+        desc.layout = pipelineLayout;
+        desc.renderPass = renderPass;
+        desc.subpass = 0;
+        desc.colorFormats = renderGraph.GetColorFormats(mainPass);
+        desc.depthFormat = renderGraph.GetDepthFormat(mainPass);
+        graphicsPipeline = pipelineCompiler.Submit(std::move(desc));
     }
 
     void CreateCommandPool(){
+        // command buffer每一帧都会重新录制，所以用eTransient，不再需要eResetCommandBuffer
         auto createInfo = vk::CommandPoolCreateInfo();
         createInfo.setQueueFamilyIndex(familyIndices.graphicsFamily.value())
-                  .setFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer);
-        commandPool = device.createCommandPool(createInfo);
+                  .setFlags(vk::CommandPoolCreateFlagBits::eTransient);
+        auto workerCount = options.recordThreads > 0 ? options.recordThreads : ThreadPool::DefaultThreadCount();
+        recordPool = std::make_unique<ThreadPool>(workerCount);
+        frames.resize(framesInFlight);
+        for (auto& frame : frames) {
+            frame.commandPools.resize(workerCount + 1);
+            for (auto& pool : frame.commandPools) {
+                pool = device.createCommandPool(createInfo);
+            }
+            frame.secondaryBuffers.resize(frame.commandPools.size());
+            frame.secondaryUsed.resize(frame.commandPools.size());
+        }
     }
 
+    // command buffer是跟着飞行中的帧走的，不是跟着swapchain的image走的，和fence用同一个currentFrame索引
     void CreateCommandBuffers(){
-        commandBuffers.resize(swapChainInfo.imageViews.size());
-        auto allocateInfo = vk::CommandBufferAllocateInfo();
-        allocateInfo.setCommandPool(commandPool)
-                    .setLevel(vk::CommandBufferLevel::ePrimary)
-                    .setCommandBufferCount(static_cast<uint32_t>(commandBuffers.size()));
-        commandBuffers = device.allocateCommandBuffers(allocateInfo);
+        for (auto& frame : frames) {
+            auto allocateInfo = vk::CommandBufferAllocateInfo();
+            allocateInfo.setCommandPool(frame.commandPools[0])
+                        .setLevel(vk::CommandBufferLevel::ePrimary)
+                        .setCommandBufferCount(1);
+            frame.commandBuffer = device.allocateCommandBuffers(allocateInfo).front();
+        }
     }
 
-    void RecordCommandBuffer(vk::CommandBuffer commandBuffer, uint32_t imageIndex){
-        auto beginInfo = vk::CommandBufferBeginInfo();
-        commandBuffer.begin(beginInfo);
-
-        auto renderPassInfo = vk::RenderPassBeginInfo();
-        auto clearColor = vk::ClearValue();
-        clearColor.setColor({82.0f / 255.0f, 82.0f / 255.0f, 136.0f / 255.0f, 1.0f});
-        renderPassInfo.setRenderPass(renderPass)
-                      .setFramebuffer(framebuffers[imageIndex])
-                      .setRenderArea({ {0, 0}, swapChainInfo.extent })
-                      .setPClearValues(&clearColor)
-                      .setClearValueCount(1);
-        commandBuffer.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
-        commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, graphicsPipeline);
+    void CreateStagingRing(){
+        // 有专用的传输队列的时候上传和渲染并行，buffer的所有权由stagingRing转移给图形队列族
+        stagingRing.Init(device, allocator, uploadTimeline, transferQueue, familyIndices.transferFamily.value(), familyIndices.graphicsFamily.value());
+    }
+
+    void WriteTrace(){
+        if (Tracer::WriteJson("trace.json")) {
+            std::cout << "Trace written to trace.json, open it in chrome://tracing or ui.perfetto.dev" << std::endl;
+        }
+    }
+
+    void CreateGpuProfiler(){
+        if (!options.gpuProfile && options.traceFrames == 0) return;
+        gpuProfiler.Init(vkInstance, physicalDevice, device, familyIndices.graphicsFamily.value(), calibratedTimestamps);
+        if (!gpuProfiler.Enabled()) {
+            std::cout << "GPU profiler disabled: graphics queue does not support timestamps" << std::endl;
+        }
+    }
+
+    void CreateReadbackRing(){
+        // 交换链的image没有TRANSFER_SRC用途，最后的布局也是给present用的，所以只有离屏渲染的时候才回读
+        readbackEnabled = headless && options.readbackInterval > 0;
+        if (!readbackEnabled) return;
+        auto callback = options.readbackCallback ? options.readbackCallback : ReadbackRing::Callback(SaveReadbackAsPpm);
+        // 每一帧最多占一个slot，完成之后下一帧开头的Poll就会还回来，所以比帧数多一个就不会丢帧
+        auto slotSize = static_cast<vk::DeviceSize>(swapChainInfo.extent.width) * swapChainInfo.extent.height * ReadbackRing::BytesPerPixel(swapChainInfo.format.format);
+        readbackRing.Init(allocator, timeline, framesInFlight + 1, slotSize, std::move(callback));
+    }
+
+    static void SaveReadbackAsPpm(const ReadbackRing::Result& result){
+        auto filename = "frame_" + std::to_string(result.frameId) + ".ppm";
+        std::ofstream file(filename, std::ios::binary);
+        file << "P6\n" << result.extent.width << " " << result.extent.height << "\n255\n";
+        auto bytesPerPixel = ReadbackRing::BytesPerPixel(result.format);
+        auto pixels = static_cast<const char*>(result.data);
+        bool bgr = result.format == vk::Format::eB8G8R8A8Unorm || result.format == vk::Format::eB8G8R8A8Srgb;
+        for (vk::DeviceSize i = 0; i + bytesPerPixel <= result.size; i += bytesPerPixel) {
+            char rgb[3] = { pixels[i + (bgr ? 2 : 0)], pixels[i + 1], pixels[i + (bgr ? 0 : 2)] };
+            file.write(rgb, 3);
+        }
+    }
+
+    // 从frame的第poolIndex个pool中拿一个secondary command buffer，不够的时候再分配
+    vk::CommandBuffer AcquireSecondaryBuffer(FrameResources& frame, uint32_t poolIndex){
+        auto& buffers = frame.secondaryBuffers[poolIndex];
+        auto& used = frame.secondaryUsed[poolIndex];
+        if (used == buffers.size()) {
+            auto allocateInfo = vk::CommandBufferAllocateInfo();
+            allocateInfo.setCommandPool(frame.commandPools[poolIndex])
+                        .setLevel(vk::CommandBufferLevel::eSecondary)
+                        .setCommandBufferCount(1);
+            buffers.push_back(device.allocateCommandBuffers(allocateInfo).front());
+        }
+        return buffers[used++];
+    }
+
+    // 录制[first, first + count)范围内的draw，secondary command buffer不会继承主command buffer的状态，所以每次都要重新绑定
+    // dispatch平时就是deviceDispatch，只有RunDispatchBenchmark会传别的函数表进来
+    void RecordDraws(vk::CommandBuffer commandBuffer, vk::Pipeline pipeline, size_t first, size_t count, const DeviceDispatch& dispatch){
+        commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline, dispatch);
 
         // 更新viewport和scissor
         auto viewport = vk::Viewport();
@@ -616,110 +1004,523 @@ private:
                 .setHeight(static_cast<float>(swapChainInfo.extent.height))
                 .setMinDepth(0.0f)
                 .setMaxDepth(1.0f);
-        commandBuffer.setViewport(0, viewport);
+        commandBuffer.setViewport(0, viewport, dispatch);
 
         auto scissor = vk::Rect2D();
         scissor.setOffset({0, 0})
                .setExtent(swapChainInfo.extent);
-        commandBuffer.setScissor(0, scissor);
+        commandBuffer.setScissor(0, scissor, dispatch);
 
-        commandBuffer.bindVertexBuffers(0, {vertexBuffer}, {0}); // 绑定顶点缓冲区
+        commandBuffer.bindVertexBuffers(0, {vertexBuffer.buffer}, {0}, dispatch); // 绑定顶点缓冲区
+        commandBuffer.bindIndexBuffer(indexBuffer.buffer, 0, indexType, dispatch); // 绑定索引缓冲区
 
-        // 第1个参数是vertex count，也就是顶点数量
+        // 第1个参数是index count，也就是索引数量
         // 第2个参数是instance count，也就是实例数量，不用instance就设置为1
-        // 第3个参数是起始vertex index，也就是gl_VertexIndex的起始值，也能说是偏移值
-        // 第4个参数是起始instance index，也就是gl_InstanceIndex的起始值，也能说是偏移值
-        commandBuffer.draw(vertices.size(), 1, 0, 0);
-        commandBuffer.endRenderPass();
-        commandBuffer.end();
+        // 第3个参数是起始的索引，从索引缓冲区的第几个索引开始读
+        // 第4个参数是vertex offset，读出来的索引加上这个值才是顶点的下标
+        // 第5个参数是起始instance index，也就是gl_InstanceIndex的起始值，也能说是偏移值
+        for (size_t i = first; i < first + count; ++i) {
+            commandBuffer.drawIndexed(drawCommands[i].indexCount, 1, drawCommands[i].firstIndex, 0, 0, dispatch);
+        }
+    }
+
+    // 把所有的draw分成taskCount段，每段在工作线程里面录制到自己的secondary command buffer中
+    // 返回的顺序和draw的顺序一致，主command buffer按顺序execute就行
+    std::vector<vk::CommandBuffer> RecordSecondaryBuffers(FrameResources& frame, vk::Pipeline pipeline, const RenderGraph::PassContext& context, uint32_t taskCount){
+        auto inheritanceInfo = vk::CommandBufferInheritanceInfo();
+        inheritanceInfo.setRenderPass(context.RenderPass())
+                       .setSubpass(0)
+                       .setFramebuffer(context.Framebuffer());
+        // dynamic rendering没有render pass，secondary要知道attachment的格式
+        auto renderingInfo = vk::CommandBufferInheritanceRenderingInfo();
+        if (!context.RenderPass()) {
+            renderingInfo.setColorAttachmentFormats(context.ColorFormats())
+                         .setDepthAttachmentFormat(context.DepthFormat())
+                         .setRasterizationSamples(vk::SampleCountFlagBits::e1);
+            inheritanceInfo.setPNext(&renderingInfo);
+        }
 
+        std::vector<std::future<vk::CommandBuffer>> futures;
+        size_t drawsPerTask = (drawCommands.size() + taskCount - 1) / taskCount;
+        for (size_t first = 0; first < drawCommands.size(); first += drawsPerTask) {
+            auto count = std::min(drawsPerTask, drawCommands.size() - first);
+            futures.push_back(recordPool->Submit([this, &frame, &inheritanceInfo, pipeline, first, count](uint32_t threadIndex) {
+                auto commandBuffer = AcquireSecondaryBuffer(frame, threadIndex + 1); // 0号pool是主线程的
+                auto beginInfo = vk::CommandBufferBeginInfo();
+                beginInfo.setFlags(vk::CommandBufferUsageFlagBits::eRenderPassContinue | vk::CommandBufferUsageFlagBits::eOneTimeSubmit)
+                         .setPInheritanceInfo(&inheritanceInfo);
+                commandBuffer.begin(beginInfo, deviceDispatch);
+                TraceScope scope("RecordDraws");
+                RecordDraws(commandBuffer, pipeline, first, count, deviceDispatch);
+                commandBuffer.end(deviceDispatch);
+                return commandBuffer;
+            }));
+        }
+        std::vector<vk::CommandBuffer> secondaryBuffers;
+        for (auto& future : futures) {
+            secondaryBuffers.push_back(future.get());
+        }
+        return secondaryBuffers;
+    }
+
+    void RecordCommandBuffer(vk::CommandBuffer commandBuffer, uint32_t imageIndex, uint32_t maxTasks = 0, bool readback = false){
+        auto& frame = frames[currentFrame];
+        std::fill(frame.secondaryUsed.begin(), frame.secondaryUsed.end(), 0);
+
+        auto beginInfo = vk::CommandBufferBeginInfo();
+        commandBuffer.begin(beginInfo, deviceDispatch);
+        uploadWaitValue = 0;
+        stagingRing.RecordAcquireBarriers(commandBuffer, uploadWaitValue, deviceDispatch); // 传输队列上传完的buffer在用之前先拿到所有权
+        gpuProfiler.BeginFrame(commandBuffer, currentFrame);
+        auto frameScope = gpuProfiler.BeginScope(commandBuffer, "frame");
+
+        // 布局转换和pass之间的barrier都由renderGraph插入
+        recordMaxTasks = maxTasks;
+        renderGraph.SetImportedImage(colorTarget, swapChainInfo.images[imageIndex], swapChainInfo.imageViews[imageIndex], swapChainInfo.extent);
+        if (readbackPass != RenderGraph::INVALID) renderGraph.SetPassEnabled(readbackPass, readback);
+        renderGraph.Execute(commandBuffer);
+
+        gpuProfiler.EndScope(commandBuffer, frameScope);
+        commandBuffer.end(deviceDispatch);
+    }
+
+    void RecordMainPass(RenderGraph::PassContext& context){
+        auto& frame = frames[currentFrame];
+        auto commandBuffer = context.commandBuffer;
+        // 管线还没编译好的时候只清屏，不绘制，不要为了等管线卡住这一帧
+        auto pipeline = graphicsPipeline.Get();
+        // draw少的时候直接在主线程录制，多的时候分给工作线程录制到secondary command buffer里面
+        auto maxTasks = recordMaxTasks == 0 ? recordPool->Size() : recordMaxTasks;
+        auto taskCount = std::min<size_t>(maxTasks, drawCommands.size() / MIN_DRAWS_PER_RECORD_TASK);
+        auto passScope = gpuProfiler.BeginScope(commandBuffer, "main pass"); // 用secondary的时候render pass里面不能写timestamp
+        if (!pipeline) {
+            context.BeginRenderPass(vk::SubpassContents::eInline);
+        } else if (taskCount <= 1) {
+            context.BeginRenderPass(vk::SubpassContents::eInline);
+            RecordDraws(commandBuffer, pipeline, 0, drawCommands.size(), deviceDispatch);
+        } else {
+            context.BeginRenderPass(vk::SubpassContents::eSecondaryCommandBuffers);
+            commandBuffer.executeCommands(RecordSecondaryBuffers(frame, pipeline, context, static_cast<uint32_t>(taskCount)), deviceDispatch);
+        }
+        context.EndRenderPass();
+        gpuProfiler.EndScope(commandBuffer, passScope);
+    }
+
+    // 性能测试只录制不提交，渲染到第一张image就行，和正常的帧一样按当前的方式(render pass或者dynamic rendering)开始
+    RenderGraph::PassContext BeginBenchmarkPass(vk::CommandBuffer commandBuffer, vk::SubpassContents contents){
+        renderGraph.SetImportedImage(colorTarget, swapChainInfo.images[0], swapChainInfo.imageViews[0], swapChainInfo.extent);
+        return renderGraph.BeginPass(mainPass, commandBuffer, contents);
+    }
+
+    // 录制性能测试：同样数量的draw，分别用1个、2个、4个...线程录制，看录制时间是不是随着核数下降
+    void RunRecordBenchmark(uint32_t drawCount){
+        auto pipeline = graphicsPipeline.Wait();
+        if (!pipeline) return;
+        auto savedDraws = drawCommands;
+        drawCommands.assign(drawCount, DrawCommand{ indexCount, 0 });
+
+        const int iterations = 20;
+        std::cout << "Record benchmark: " << drawCount << " draws, " << iterations << " iterations" << std::endl;
+        double singleThreadMs = 0.0;
+        for (uint32_t threads = 1; threads <= recordPool->Size(); threads = threads == recordPool->Size() ? threads + 1 : std::min(threads * 2, recordPool->Size())) {
+            auto& frame = frames[currentFrame];
+            double totalMs = 0.0;
+            for (int i = 0; i < iterations; ++i) {
+                for (auto pool : frame.commandPools) {
+                    device.resetCommandPool(pool);
+                }
+                auto startTime = std::chrono::steady_clock::now();
+                // 1个线程的时候也走secondary的路径，这样对比的只有线程数量
+                std::fill(frame.secondaryUsed.begin(), frame.secondaryUsed.end(), 0);
+                frame.commandBuffer.begin(vk::CommandBufferBeginInfo());
+                auto context = BeginBenchmarkPass(frame.commandBuffer, vk::SubpassContents::eSecondaryCommandBuffers);
+                frame.commandBuffer.executeCommands(RecordSecondaryBuffers(frame, pipeline, context, threads));
+                context.EndRenderPass();
+                frame.commandBuffer.end();
+                totalMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+            }
+            auto averageMs = totalMs / iterations;
+            if (threads == 1) singleThreadMs = averageMs;
+            std::cout << "  " << threads << " thread(s): " << averageMs << " ms per frame, speedup " << singleThreadMs / averageMs << "x" << std::endl;
+        }
+        for (auto pool : frames[currentFrame].commandPools) {
+            device.resetCommandPool(pool);
+        }
+        drawCommands = savedDraws;
+    }
+
+    // 函数调用方式的性能测试：同样在主线程录制drawCount个draw，分别用loader导出的函数和vkGetDeviceProcAddr拿到的函数
+    // 两种函数表交替测，避免CPU频率变化只影响其中一种
+    void RunDispatchBenchmark(uint32_t drawCount){
+        auto pipeline = graphicsPipeline.Wait();
+        if (!pipeline) return;
+        auto savedDraws = drawCommands;
+        drawCommands.assign(drawCount, DrawCommand{ indexCount, 0 });
+
+        DeviceDispatch loaderDispatch;
+        loaderDispatch.Init(device, false);
+        DeviceDispatch directDispatch;
+        directDispatch.Init(device, true);
+        const std::array<std::pair<const char*, const DeviceDispatch*>, 2> dispatches = {{ { "loader", &loaderDispatch }, { "direct", &directDispatch } }};
+
+        const int iterations = 20;
+        std::array<double, 2> totalMs = {};
+        auto& frame = frames[currentFrame];
+        for (int i = -1; i < iterations; ++i) { // 第-1次是预热，不计时
+            for (size_t j = 0; j < dispatches.size(); ++j) {
+                const auto& dispatch = *dispatches[j].second;
+                device.resetCommandPool(frame.commandPools[0], {}, dispatch);
+                auto startTime = std::chrono::steady_clock::now();
+                frame.commandBuffer.begin(vk::CommandBufferBeginInfo(), dispatch);
+                auto context = BeginBenchmarkPass(frame.commandBuffer, vk::SubpassContents::eInline); // 开始和结束一帧只有一次，用的是renderGraph的函数表
+                RecordDraws(frame.commandBuffer, pipeline, 0, drawCommands.size(), dispatch);
+                context.EndRenderPass();
+                frame.commandBuffer.end(dispatch);
+                if (i >= 0) totalMs[j] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+            }
+        }
+        std::cout << "Dispatch benchmark: " << drawCount << " draws, " << iterations << " iterations" << std::endl;
+        for (size_t j = 0; j < dispatches.size(); ++j) {
+            auto averageMs = totalMs[j] / iterations;
+            std::cout << "  " << dispatches[j].first << ": " << averageMs << " ms per frame, "
+                      << averageMs * 1e6 / drawCount << " ns per draw" << std::endl;
+        }
+        std::cout << "  direct saves " << (totalMs[0] - totalMs[1]) / iterations << " ms per frame" << std::endl;
+        device.resetCommandPool(frame.commandPools[0]);
+        drawCommands = savedDraws;
     }
 
     void CreateSyncObjects(){
-        imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+        imageAvailableSemaphores.resize(framesInFlight);
+        renderFinishedSemaphores.resize(framesInFlight);
+        // 初始值为0，timeline一开始就是0，所以第一次渲染的时候不会一直等待导致死锁
+        frameTimelineValues.assign(framesInFlight, 0);
 
+        // acquire和present只支持binary semaphore，所以这两个还是要保留
         auto semaphoreCreateInfo = vk::SemaphoreCreateInfo();
-        auto fenceCreateInfo = vk::FenceCreateInfo();
-        fenceCreateInfo.setFlags(vk::FenceCreateFlagBits::eSignaled); // 初始状态为signaled，防止第一次渲染的时候一直等待signaled导致死锁
-    
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (size_t i = 0; i < framesInFlight; i++) {
             imageAvailableSemaphores[i] = device.createSemaphore(semaphoreCreateInfo);
             renderFinishedSemaphores[i] = device.createSemaphore(semaphoreCreateInfo);
-            inFlightFences[i] = device.createFence(fenceCreateInfo);
         }
     }
 
     void DrawPerFrame(){
-        auto result = device.waitForFences(inFlightFences[currentFrame], true, UINT64_MAX); // 等待上一帧渲染完成
-        if (result != vk::Result::eSuccess) {
-            throw std::runtime_error("failed to wait for fence!");
+        TraceScope frameScope("DrawPerFrame");
+        {
+            TraceScope scope("WaitFrame");
+            timeline.Wait(frameTimelineValues[currentFrame]); // 等待framesInFlight帧之前用这一套资源的那一帧渲染完成
+        }
+        stagingRing.Poll(); // 回收已经上传完成的暂存空间，不会阻塞
+        deletionQueue.Collect(); // 销毁GPU已经用完的对象，每帧有上限，不会阻塞
+        if (readbackEnabled) readbackRing.Poll(); // 已经拷贝完的回读结果交给回调，不会阻塞
+        // 这一帧之前的命令都执行完了，可以把整个pool一次性reset
+        for (auto pool : frames[currentFrame].commandPools) {
+            device.resetCommandPool(pool, {}, deviceDispatch);
         }
         uint32_t imageIndex;
-        result = device.acquireNextImageKHR(swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], nullptr, &imageIndex); // 获取下一帧的imageIndex
-        if (result == vk::Result::eErrorOutOfDateKHR) {
+        if (!AcquireImage(imageIndex)) return;
+        auto commandBuffer = frames[currentFrame].commandBuffer;
+        bool readback = readbackEnabled && frameNumber % options.readbackInterval == 0;
+        {
+            TraceScope scope("RecordCommandBuffer");
+            RecordCommandBuffer(commandBuffer, imageIndex, 0, readback); // 记录command buffer
+        }
+        SubmitFrame(commandBuffer);
+        if (!firstFrameReported) {
+            firstFrameReported = true;
+            auto elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+            report.firstFrameMs = elapsedMs;
+            std::cout << "Time to first frame: " << elapsedMs << " ms" << std::endl;
+        }
+        if (readback) readbackRing.Submitted(frameTimelineValues[currentFrame]);
+        ++frameNumber;
+        if (gpuProfiler.Enabled() && options.gpuProfileInterval > 0 && frameNumber % options.gpuProfileInterval == 0) {
+            gpuProfiler.Dump(std::cout);
+        }
+        if (frameNumber == options.traceFrames) {
+            WriteTrace();
+            Tracer::Enable(false); // 只记录前面这些帧，后面的事件不要了
+        }
+        PresentImage(imageIndex);
+        currentFrame = (currentFrame + 1) % framesInFlight;
+    }
+
+    // 获取这一帧要渲染的image，无窗口模式下离屏的image轮流使用
+    // 返回false表示交换链过期了，这一帧跳过
+    bool AcquireImage(uint32_t& imageIndex){
+        if (headless) {
+            imageIndex = nextOffscreenImage;
+            nextOffscreenImage = (nextOffscreenImage + 1) % swapChainInfo.imageCount;
+            return true;
+        }
+        if (swapChainOutOfDate && !RecreateSwapChain()) [[unlikely]] return false;
+        if (useSwapchainExceptions) [[unlikely]] return AcquireImageWithExceptions(imageIndex);
+        TraceScope scope("AcquireNextImage");
+        // 用返回vk::Result的重载，交换链过期是正常情况，不应该走异常
+        auto result = device.acquireNextImageKHR(swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], nullptr, &imageIndex, deviceDispatch); // 获取下一帧的imageIndex
+        if (result == vk::Result::eErrorOutOfDateKHR) [[unlikely]] {
             RecreateSwapChain();
-            return;
-        } else if (result != vk::Result::eSuccess && result != vk::Result::eSuboptimalKHR) {
-            throw std::runtime_error("failed to acquire swap chain image!");
+            return false;
+        } else if (result != vk::Result::eSuccess && result != vk::Result::eSuboptimalKHR) [[unlikely]] {
+            throw std::runtime_error("failed to acquire swap chain image: " + vk::to_string(result));
+        }
+        return true; // suboptimal的时候这一帧照样画，present之后再重建
+    }
+
+    void SubmitFrame(vk::CommandBuffer commandBuffer){
+        // 同时signal给present用的binary semaphore和timeline semaphore，binary semaphore对应的值会被忽略
+        // 每一帧都会走这里，用固定大小的数组，不在堆上分配
+        frameTimelineValues[currentFrame] = timeline.NextValue();
+        std::array<vk::Semaphore, 2> signalSemaphores = { timeline.Get(), renderFinishedSemaphores[currentFrame] };
+        std::array<uint64_t, 2> signalValues = { frameTimelineValues[currentFrame], 0 };
+        uint32_t signalCount = headless ? 1 : 2; // 无窗口模式下没有acquire和present，不需要这两个binary semaphore
+
+        // 等acquire的binary semaphore，这一帧acquire了传输队列上传的buffer的时候还要等那一次上传完成
+        std::array<vk::Semaphore, 2> waitSemaphores;
+        std::array<uint64_t, 2> waitValues = {};
+        std::array<vk::PipelineStageFlags, 2> waitStages;
+        uint32_t waitCount = 0;
+        if (!headless) {
+            waitSemaphores[waitCount] = imageAvailableSemaphores[currentFrame];
+            waitStages[waitCount++] = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+        }
+        if (uploadWaitValue > 0) [[unlikely]] {
+            waitSemaphores[waitCount] = uploadTimeline.Get();
+            waitValues[waitCount] = uploadWaitValue;
+            waitStages[waitCount++] = vk::PipelineStageFlagBits::eVertexInput; // 要和StagingRing里acquire的dstStage一样
         }
-        device.resetFences(inFlightFences[currentFrame]); // 重置fence
-        commandBuffers[imageIndex].reset(); // 重置command buffer
-        RecordCommandBuffer(commandBuffers[imageIndex], imageIndex); // 记录command buffer
+
+        auto timelineInfo = vk::TimelineSemaphoreSubmitInfo();
+        timelineInfo.setWaitSemaphoreValueCount(waitCount)
+                    .setPWaitSemaphoreValues(waitValues.data())
+                    .setSignalSemaphoreValueCount(signalCount)
+                    .setPSignalSemaphoreValues(signalValues.data());
 
         auto submitInfo = vk::SubmitInfo();
-        std::vector<vk::PipelineStageFlags> waitStages = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
-        submitInfo.setWaitSemaphores(imageAvailableSemaphores[currentFrame])
-                  .setWaitDstStageMask(waitStages)
-                  .setCommandBuffers(commandBuffers[imageIndex])
-                  .setSignalSemaphores(renderFinishedSemaphores[currentFrame]);
-        graphicsQueue.submit(submitInfo, inFlightFences[currentFrame]); // 提交渲染命令
+        submitInfo.setWaitSemaphoreCount(waitCount)
+                  .setPWaitSemaphores(waitSemaphores.data())
+                  .setPWaitDstStageMask(waitStages.data())
+                  .setCommandBuffers(commandBuffer)
+                  .setSignalSemaphoreCount(signalCount)
+                  .setPSignalSemaphores(signalSemaphores.data())
+                  .setPNext(&timelineInfo);
+        TraceScope scope("Submit");
+        auto result = graphicsQueue.submit(1, &submitInfo, nullptr, deviceDispatch); // 提交渲染命令
+        if (result != vk::Result::eSuccess) [[unlikely]] {
+            throw std::runtime_error("failed to submit draw command buffer: " + vk::to_string(result));
+        }
+    }
 
+    void PresentImage(uint32_t imageIndex){
+        if (headless) return;
+        if (useSwapchainExceptions) [[unlikely]] return PresentImageWithExceptions(imageIndex);
+        TraceScope scope("Present");
         auto presentInfo = vk::PresentInfoKHR();
         presentInfo.setWaitSemaphores(renderFinishedSemaphores[currentFrame])
                   .setSwapchains(swapChain)
                   .setImageIndices(imageIndex)
                   .setSwapchainCount(1);
 
-        
-        // 真抽象，C++中如果当前的swapchain过时了是直接抛出异常
-        try{
-            result = presentQueue.presentKHR(presentInfo); // 显示帧
-        }
-        catch(const vk::OutOfDateKHRError& e){
+        // 传指针的重载直接返回vk::Result，交换链过期不会抛异常
+        auto result = presentQueue.presentKHR(&presentInfo, deviceDispatch); // 显示帧
+        if (result == vk::Result::eErrorOutOfDateKHR || result == vk::Result::eSuboptimalKHR || framebufferResized) [[unlikely]] {
             framebufferResized = false;
             RecreateSwapChain();
+        } else if (result != vk::Result::eSuccess) [[unlikely]] {
+            throw std::runtime_error("failed to present swap chain image: " + vk::to_string(result));
+        }
+    }
+
+    // 原来用异常处理交换链过期的写法，只留给RunResizeBenchmark做对比
+    bool AcquireImageWithExceptions(uint32_t& imageIndex){
+        try {
+            imageIndex = device.acquireNextImageKHR(swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], nullptr).value;
+        } catch (const vk::OutOfDateKHRError&) {
+            RecreateSwapChain();
+            return false;
         }
-        if (result != vk::Result::eSuccess) {
-            throw std::runtime_error("failed to present swap chain image!");
+        return true;
+    }
+
+    void PresentImageWithExceptions(uint32_t imageIndex){
+        auto presentInfo = vk::PresentInfoKHR();
+        presentInfo.setWaitSemaphores(renderFinishedSemaphores[currentFrame])
+                  .setSwapchains(swapChain)
+                  .setImageIndices(imageIndex);
+        // 真抽象，C++中如果当前的swapchain过时了是直接抛出异常
+        try {
+            auto result = presentQueue.presentKHR(presentInfo); // 显示帧
+            if (result == vk::Result::eSuboptimalKHR || framebufferResized) {
+                framebufferResized = false;
+                RecreateSwapChain();
+            }
+        } catch (const vk::OutOfDateKHRError&) {
+            framebufferResized = false;
+            RecreateSwapChain();
         }
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
     }
 
-    void RecreateSwapChain(){
+    // 交换链重建风暴测试：连续修改窗口大小，比较返回值和异常两种处理方式每一帧的耗时
+    // 先单独测一次抛出并捕获vk::OutOfDateKHRError的开销，这一部分在无窗口模式下也能跑
+    void RunResizeBenchmark(uint32_t iterations){
+        volatile auto outOfDate = vk::Result::eErrorOutOfDateKHR; // 不让编译器把分支优化掉
+        const uint32_t microIterations = iterations * 100;
+        uint32_t handled = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < microIterations; ++i) {
+            if (outOfDate == vk::Result::eErrorOutOfDateKHR) ++handled;
+        }
+        auto resultNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / microIterations;
+        start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < microIterations; ++i) {
+            try {
+                if (outOfDate == vk::Result::eErrorOutOfDateKHR) throw vk::OutOfDateKHRError("vkQueuePresentKHR");
+            } catch (const vk::OutOfDateKHRError&) {
+                ++handled;
+            }
+        }
+        auto exceptionNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / microIterations;
+        std::cout << "Out-of-date handling: result code " << resultNs << " ns, exception " << exceptionNs << " ns ("
+                  << handled << " handled)" << std::endl;
+        if (headless) return;
+
         int width = 0, height = 0;
-        glfwGetFramebufferSize(window, &width, &height);
-        while (width == 0 || height == 0) {
+        glfwGetWindowSize(window, &width, &height);
+        for (bool exceptions : { false, true }) {
+            useSwapchainExceptions = exceptions;
+            FrameStats frameMs;
+            auto recreatesBefore = swapchainRecreateCount;
+            for (uint32_t i = 0; i < iterations && !ShouldClose(); ++i) {
+                // 每一帧都换一个大小，让acquire/present不停地返回过期
+                glfwSetWindowSize(window, width + static_cast<int>(i % 8) * 16, height + static_cast<int>(i % 8) * 16);
+                PollEvents();
+                auto frameStart = std::chrono::steady_clock::now();
+                DrawPerFrame();
+                frameMs.Add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+            }
+            std::cout << "Resize storm (" << (exceptions ? "exceptions" : "result codes") << "): " << iterations << " frames, "
+                      << swapchainRecreateCount - recreatesBefore << " recreations, frame avg " << frameMs.Average()
+                      << " ms p99 " << frameMs.Percentile(99) << " ms max " << frameMs.Max() << " ms" << std::endl;
+        }
+        useSwapchainExceptions = false;
+        glfwSetWindowSize(window, width, height);
+    }
+
+    // 销毁所有按framesInFlight数量创建的资源，调用之前GPU必须是空闲的
+    void DestroyFrameResources(){
+        for (size_t i = 0; i < imageAvailableSemaphores.size(); i++) {
+            device.destroySemaphore(imageAvailableSemaphores[i]);
+            device.destroySemaphore(renderFinishedSemaphores[i]);
+        }
+        imageAvailableSemaphores.clear();
+        renderFinishedSemaphores.clear();
+
+        recordPool.reset();
+
+        for (auto& frame : frames) {
+            for (auto pool : frame.commandPools) {
+                device.destroyCommandPool(pool);
+            }
+        }
+        frames.clear();
+    }
+
+    // 运行时修改飞行中的帧数和交换链的image数量，每一帧的资源和同步对象都要按新的数量重新创建
+    void ApplyFrameSettings(uint32_t newFramesInFlight, uint32_t newImageCount){
+        device.waitIdle();
+        DestroyFrameResources();
+        framesInFlight = std::max(1u, newFramesInFlight);
+        desiredImageCount = newImageCount;
+        currentFrame = 0;
+        CreateCommandPool();
+        CreateCommandBuffers();
+        CreateSyncObjects();
+        RecreateSwapChain();
+    }
+
+    // 延迟和吞吐的测试：飞行中的帧越多GPU越不容易闲着，但是输入到画面显示的延迟也越大
+    // 每种配置先跑一些帧预热，然后统计CPU的帧时间和从采样输入到这一帧渲染完成的时间
+    void RunLatencyTest(uint32_t frameCount){
+        graphicsPipeline.Wait();
+        std::cout << "Latency test: " << frameCount << " frames per setting" << std::endl;
+        for (uint32_t images : { 2u, 3u }) {
+            for (uint32_t inFlight : { 1u, 2u, 3u }) {
+                ApplyFrameSettings(inFlight, images);
+                LatencyProbe probe;
+                probe.Start(device, timeline.Get());
+                FrameStats frameTimes;
+                auto lastFrameTime = LatencyProbe::Clock::now();
+                for (uint32_t i = 0; i < frameCount + 10 && !ShouldClose(); ++i) {
+                    PollEvents();
+                    auto inputTime = LatencyProbe::Clock::now(); // 刚处理完输入的时间
+                    auto lastSignaled = timeline.LastSignaled();
+                    DrawPerFrame();
+                    auto now = LatencyProbe::Clock::now();
+                    if (i >= 10) { // 前10帧用来预热
+                        frameTimes.Add(std::chrono::duration<double, std::milli>(now - lastFrameTime).count());
+                        if (timeline.LastSignaled() != lastSignaled) {
+                            probe.Track(timeline.LastSignaled(), inputTime);
+                        }
+                    }
+                    lastFrameTime = now;
+                }
+                probe.Flush();
+                probe.Stop();
+                auto latencies = probe.Collect();
+                std::cout << "  frames in flight " << framesInFlight << ", swapchain images " << swapChainInfo.imageCount
+                          << ": frame time avg " << frameTimes.Average() << " ms, p99 " << frameTimes.Percentile(99)
+                          << " ms | input latency avg " << latencies.Average() << " ms, p99 " << latencies.Percentile(99) << " ms" << std::endl;
+            }
+        }
+        ApplyFrameSettings(options.framesInFlight, options.swapchainImages);
+    }
+
+    // 不等GPU空闲，旧的交换链传给新的交换链之后交给deletionQueue，在飞的帧照样渲染和显示
+    // 返回false表示窗口最小化了，这一帧跳过，之后每一帧acquire之前再试
+    bool RecreateSwapChain(){
+        if (!headless) {
+            int width = 0, height = 0;
             glfwGetFramebufferSize(window, &width, &height);
-            glfwWaitEvents();
+            if (width == 0 || height == 0) {
+                swapChainOutOfDate = true;
+                glfwWaitEvents(); // 最小化的时候不用渲染，等下一个窗口事件，不空转也不会错过关闭窗口
+                return false;
+            }
         }
+        swapChainOutOfDate = false;
         // 理论上渲染通道也需要重新创建，因为渲染通道依赖于SwapChain的Format，重建交换链之后这个Format可能会发生改变
-        device.waitIdle();
-        ClearSwapChain();
-        CreateSwapChain();
+        // 旧的资源交给延迟销毁队列：已经提交的帧到LastSignaled就全部执行完了，再多等framesInFlight帧，让显示引擎也用完旧的image
+        auto oldSwapChain = swapChain;
+        auto oldImageViews = std::exchange(swapChainInfo.imageViews, {});
+        auto oldOffscreenImages = std::exchange(offscreenImages, {});
+        CreateSwapChain(); // swapChain还是旧的，会被当作oldSwapchain
         CreateImageViews();
-        CreateFramebuffers();
+        auto retireValue = timeline.LastSignaled() + framesInFlight;
+        // 引用旧image view的framebuffer先放进去，新的framebuffer在第一次用到的时候创建，临时attachment按新的大小重建
+        renderGraph.Resize(swapChainInfo.extent, deletionQueue, retireValue);
+        for (auto imageView : oldImageViews) {
+            deletionQueue.Push(imageView, retireValue);
+        }
+        for (auto& image : oldOffscreenImages) {
+            deletionQueue.Push(image, retireValue);
+        }
+        deletionQueue.Push(oldSwapChain, retireValue); // 无窗口模式下是空的，会被忽略
+        ++swapchainRecreateCount;
+        return true;
     }
 
+    // 销毁当前的交换链，调用之前GPU必须是空闲的，旧的交换链在deletionQueue里面一起销毁
     void ClearSwapChain(){
-        for (auto i = 0; i < framebuffers.size(); ++i){
-            device.destroyFramebuffer(framebuffers[i]);
+        for (auto imageView : swapChainInfo.imageViews) {
+            device.destroyImageView(imageView);
         }
-        for (auto i = 0; i < swapChainInfo.imageViews.size(); ++i){
-            device.destroyImageView(swapChainInfo.imageViews[i]);
+        swapChainInfo.imageViews.clear();
+        for (auto& image : offscreenImages) {
+            allocator.DestroyImage(image);
         }
-        device.destroySwapchainKHR(swapChain);
+        offscreenImages.clear();
+        if (swapChain) device.destroySwapchainKHR(swapChain); // 无窗口模式下没有交换链
+        swapChain = nullptr;
     }
 
     static void FramebufferResizeCallback(GLFWwindow* window, int width, int height) {
@@ -727,49 +1528,134 @@ private:
         app->framebufferResized = true;
     }
 
-    void CreateVertexBuffers(){
-        auto vertexBufferInfo = vk::BufferCreateInfo();
-        vertexBufferInfo.setSize(vertices.size() * sizeof(Vertex))
-                        .setUsage(vk::BufferUsageFlagBits::eVertexBuffer) // 指定这个数据的用途
-                        .setSharingMode(vk::SharingMode::eExclusive); // 独占访问，不能给其他的队列使用
-        vertexBuffer = device.createBuffer(vertexBufferInfo);
-        // 上面是定义缓冲区,但是还没有分配GPU内存的
-
-        // 这个能获取到指定的buffer的大小,偏移,和内存类型
-        auto requirements = device.getBufferMemoryRequirements(vertexBuffer);
-        // 查找合适的内存类型的索引
-        auto memoryProperties = physicalDevice.getMemoryProperties();
-        uint32_t memoryTypeIndex = -1;
-        auto typeFilter = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
-        for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
-            if(requirements.memoryTypeBits & (1 << i) && (memoryProperties.memoryTypes[i].propertyFlags & typeFilter) == typeFilter){ // 找到合适的内存类型的位置
-                memoryTypeIndex = i;
-                break;
-            }
+    // 准备CPU这边的模型数据，不需要任何Vulkan对象，可以和创建instance、device同时进行
+    void PrepareModelData(){
+        if (!options.meshPath.empty()) {
+            LoadMeshFile();
+        } else {
+            GenerateModelData();
+        }
+
+        // 三角形尽量平均地分到每个draw里面
+        auto triangleCount = indexCount / 3;
+        auto drawCount = std::clamp(options.drawCount, 1u, triangleCount);
+        drawCommands.clear();
+        for (uint32_t i = 0; i < drawCount; ++i) {
+            auto first = static_cast<uint64_t>(triangleCount) * i / drawCount;
+            auto last = static_cast<uint64_t>(triangleCount) * (i + 1) / drawCount;
+            drawCommands.push_back(DrawCommand{ static_cast<uint32_t>((last - first) * 3), static_cast<uint32_t>(first * 3) });
+        }
+    }
+
+    // 转换工具已经合并和优化过了，这里只检查头，顶点和索引留在映射的内存里，CreateVertexBuffers直接从里面拷贝到暂存缓冲区
+    void LoadMeshFile(){
+        meshFile.emplace(options.meshPath);
+        const auto& header = meshFile->Header();
+        // 管线的顶点输入是固定的，文件里的布局必须完全一样才能直接拷贝
+        if (header.vertexStride != sizeof(Vertex) ||
+            !meshFile->HasAttribute(0, vk::Format::eR32G32Sfloat, offsetof(Vertex, pos)) ||
+            !meshFile->HasAttribute(1, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, color))) {
+            throw std::runtime_error("vertex layout of " + options.meshPath + " does not match the pipeline!");
         }
-        if (memoryTypeIndex == -1) {
-            throw std::runtime_error("failed to find suitable memory type!");
+        vertexCount = header.vertexCount;
+        indexCount = header.indexCount;
+        indexType = meshFile->IndexType();
+        std::cout << "Mapped mesh " << options.meshPath << ": " << vertexCount << " vertices, " << indexCount / 3 << " triangles" << std::endl;
+    }
+
+    void GenerateModelData(){
+        if (options.triangleCount > 1) {
+            // 把屏幕分成网格，每个格子放一个三角形，顶点顺序和默认的三角形一样是顺时针
+            vertices.clear();
+            vertices.reserve(static_cast<size_t>(options.triangleCount) * 3);
+            auto columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(options.triangleCount))));
+            auto cell = 2.0f / columns;
+            for (uint32_t i = 0; i < options.triangleCount; ++i) {
+                auto x = -1.0f + (i % columns) * cell;
+                auto y = -1.0f + (i / columns) * cell;
+                auto color = glm::vec3((i % 7) / 6.0f, (i % 11) / 10.0f, (i % 13) / 12.0f);
+                vertices.push_back({ { x + cell * 0.5f, y }, color });
+                vertices.push_back({ { x + cell, y + cell }, color });
+                vertices.push_back({ { x, y + cell }, color });
+            }
         }
-        // 实际分配内存
-        auto allocateInfo = vk::MemoryAllocateInfo();
-        allocateInfo.setAllocationSize(requirements.size)
-                    .setMemoryTypeIndex(memoryTypeIndex);
-        vertexBufferMemory = device.allocateMemory(allocateInfo);
-        device.bindBufferMemory(vertexBuffer, vertexBufferMemory, 0); // 偏移量,如果这块内存需要存储多个buffer就可以使用偏移量
+        // 完全一样的顶点只保留一份，vertex shader的结果可以通过post-transform cache在三角形之间复用
+        auto welded = MeshWelder::Weld(vertices.data(), vertices.size());
+        std::cout << "Welded " << vertices.size() << " vertices into " << welded.vertices.size() << std::endl;
+        vertices = std::move(welded.vertices);
+        indices = std::move(welded.indices);
+        if (options.optimizeMesh) OptimizeMesh();
+        vertexCount = static_cast<uint32_t>(vertices.size());
+        indexCount = static_cast<uint32_t>(indices.size());
+        indexType = MeshWelder::IndexTypeFor(vertices.size());
+    }
 
-        // 上面是创建buffer和分配内存,现在GPU中的准备工作做完了,所以需要将数据映射到GPU准备的buffer中去
-        void *data;
-        device.mapMemory(vertexBufferMemory, 0, vertexBufferInfo.size, vk::MemoryMapFlags(), &data); // 第一个0是偏移值,第二个是flag
-        memcpy(data, vertices.data(), vertices.size() * sizeof(Vertex)); // 将数据拷贝到GPU内存中
-        device.unmapMemory(vertexBufferMemory); // 解除映射
-        // 这里有可能解除映射之后不会马上将数据复制到GPU的内存中去,所以上面的那个eHostCoherent枚举就起作用了,实际啥原理也不知道,文档讲的是一点都不清楚
+    // 先按post-transform cache排三角形，再按簇排减少overdraw，最后按使用顺序排顶点
+    void OptimizeMesh(){
+        auto before = MeshOptimizer::AnalyzeVertexCache(indices, vertices.size());
+        indices = MeshOptimizer::OptimizeVertexCache(indices, vertices.size(), MeshOptimizer::DEFAULT_CACHE_SIZE);
+        // 不做overdraw的重排：管线没有深度附件，没有early-Z可以受益，改变三角形的先后只会改变重叠的地方谁在上面
+        // 位置也只有二维，所有簇的排序依据都是0。以后加了深度测试再在这里调用MeshOptimizer::OptimizeOverdraw
+        std::cout << "Mesh optimization: overdraw ordering skipped, the pipeline has no depth test" << std::endl;
+        vertices = MeshOptimizer::OptimizeVertexFetch(indices, vertices);
+        auto after = MeshOptimizer::AnalyzeVertexCache(indices, vertices.size());
+        std::cout << "Mesh optimization: ACMR " << before.acmr << " -> " << after.acmr
+                  << ", ATVR " << before.atvr << " -> " << after.atvr << std::endl;
     }
 
+    void CreateVertexBuffers(){
+        // 从文件加载的时候数据直接从映射的内存拷贝到暂存缓冲区，中间没有任何解析和拷贝
+        std::vector<uint8_t> packedIndices;
+        const void* vertexData = vertices.data();
+        const void* indexData = nullptr;
+        if (meshFile) {
+            vertexData = meshFile->VertexData();
+            indexData = meshFile->IndexData();
+        } else {
+            packedIndices = MeshWelder::PackIndices(indices, indexType);
+            indexData = packedIndices.data();
+        }
+        auto vertexSize = static_cast<vk::DeviceSize>(vertexCount) * sizeof(Vertex);
+        auto indexSize = static_cast<vk::DeviceSize>(indexCount) * MeshWelder::IndexSize(indexType);
+
+        auto vertexBufferInfo = vk::BufferCreateInfo();
+        vertexBufferInfo.setSize(vertexSize)
+                        .setUsage(vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst) // 指定这个数据的用途，还要作为拷贝的目标
+                        .setSharingMode(vk::SharingMode::eExclusive); // 独占访问，在传输队列上上传之后由stagingRing转移所有权
+        // 不再单独调用allocateMemory，而是从allocator的大块显存里面切一段出来，bind的时候带上偏移值
+        // 静态的顶点数据放在DEVICE_LOCAL的显存中，独显上绘制的时候就不用每次都走PCIe去读内存了
+        vertexBuffer = allocator.CreateBuffer(vertexBufferInfo, vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+        // CPU不能直接写DEVICE_LOCAL的显存，先拷贝到暂存缓冲区，再用copyBuffer命令拷贝过去
+        stagingRing.Upload(vertexBuffer.buffer, 0, vertexData, vertexSize);
+
+        auto indexBufferInfo = vk::BufferCreateInfo();
+        indexBufferInfo.setSize(indexSize)
+                       .setUsage(vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst)
+                       .setSharingMode(vk::SharingMode::eExclusive);
+        indexBuffer = allocator.CreateBuffer(indexBufferInfo, vk::MemoryPropertyFlagBits::eDeviceLocal);
+        stagingRing.Upload(indexBuffer.buffer, 0, indexData, indexSize);
+        stagingRing.Flush(); // 提交之后不用等，第一帧的提交会等这次上传完成，并且acquire这些buffer
+        meshFile.reset(); // Upload已经拷贝到暂存缓冲区了，可以解除映射
+
+        allocator.PrintStats();
+    }
 
 public:
+    static VulkanContext* GetInstance(const Options& options){
+        std::call_once(_options_flag, [&options] { _options = options; }); // 只有第一次调用的时候生效
+        return GetInstance();
+    }
+
     static VulkanContext* GetInstance(){
         std::call_once(_init_flag, CreateInstance); // 线程安全的
         return _ins.get();
     }
+
+    // 不经过单例，用给定的配置完整地跑一次(初始化、渲染、销毁)，返回统计结果，性能测试用
+    static RunReport Run(const Options& options){
+        VulkanContext context(options);
+        return context.report;
+    }
     ~VulkanContext(){}
 };
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "MeshFile.hpp"
+#include "MeshOptimizer.hpp"
+#include "MeshWelder.hpp"
+
+// 把OBJ模型转换成渲染器直接mmap加载的.vmesh
+// 用法: MeshConverter input.obj output.vmesh [--optimize 1]
+// 转换的时候合并重复的顶点、按post-transform cache重排，运行时加载就不用再做这些事
+// 不做overdraw的重排：渲染器的管线没有深度测试，改变三角形的先后会改变重叠的地方谁在上面，画出来的结果就不一样了
+// 渲染器的管线现在只有二维的位置和颜色，所以位置投影到xy平面并缩放到屏幕中间，颜色用顶点颜色，没有的话用法线
+
+// 从OBJ读出来的顶点，位置是三维的
+struct SourceVertex final {
+    float pos[3];
+    float color[3];
+};
+
+// 和VulkanContext::Vertex的布局一样，写进文件头的属性表里面，加载的时候会检查
+struct OutputVertex final {
+    float pos[2];
+    float color[3];
+};
+
+static bool ParseObj(const std::string& path, std::vector<SourceVertex>& soup) {
+    std::ifstream in(path);
+    if (!in.is_open()) return false;
+    std::vector<std::array<float, 3>> positions, colors, normals;
+    std::string line;
+    std::vector<SourceVertex> polygon;
+    while (std::getline(in, line)) {
+        std::istringstream stream(line);
+        std::string type;
+        stream >> type;
+        if (type == "v") {
+            std::array<float, 3> p = {}, c = { -1.0f, -1.0f, -1.0f };
+            stream >> p[0] >> p[1] >> p[2];
+            if (!(stream >> c[0] >> c[1] >> c[2])) c = { -1.0f, -1.0f, -1.0f }; // 有些导出工具会在位置后面带上顶点颜色
+            positions.push_back(p);
+            colors.push_back(c);
+        } else if (type == "vn") {
+            std::array<float, 3> n = {};
+            stream >> n[0] >> n[1] >> n[2];
+            normals.push_back(n);
+        } else if (type == "f") {
+            polygon.clear();
+            std::string token;
+            while (stream >> token) {
+                // v、v/vt、v//vn、v/vt/vn，下标从1开始，负数表示从后往前数
+                auto resolve = [](long index, size_t count) { return index < 0 ? static_cast<long>(count) + index : index - 1; };
+                auto firstSlash = token.find('/');
+                auto v = resolve(std::stol(token.substr(0, firstSlash)), positions.size());
+                long n = -1;
+                if (firstSlash != std::string::npos) {
+                    auto secondSlash = token.find('/', firstSlash + 1);
+                    if (secondSlash != std::string::npos && secondSlash + 1 < token.size()) {
+                        n = resolve(std::stol(token.substr(secondSlash + 1)), normals.size());
+                    }
+                }
+                if (v < 0 || static_cast<size_t>(v) >= positions.size()) {
+                    std::cerr << "invalid vertex index in: " << line << std::endl;
+                    return false;
+                }
+                SourceVertex vertex;
+                std::copy(positions[v].begin(), positions[v].end(), vertex.pos);
+                if (colors[v][0] >= 0.0f) {
+                    std::copy(colors[v].begin(), colors[v].end(), vertex.color);
+                } else if (n >= 0 && static_cast<size_t>(n) < normals.size()) {
+                    for (int axis = 0; axis < 3; ++axis) vertex.color[axis] = normals[n][axis] * 0.5f + 0.5f;
+                } else {
+                    vertex.color[0] = vertex.color[1] = vertex.color[2] = 0.8f;
+                }
+                polygon.push_back(vertex);
+            }
+            // 多边形按扇形拆成三角形
+            for (size_t i = 2; i < polygon.size(); ++i) {
+                soup.push_back(polygon[0]);
+                soup.push_back(polygon[i - 1]);
+                soup.push_back(polygon[i]);
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: MeshConverter input.obj output.vmesh [--optimize 1]" << std::endl;
+        return 1;
+    }
+    std::string inputPath = argv[1];
+    std::string outputPath = argv[2];
+    bool optimize = true;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        std::string value = argv[i + 1];
+        if (name == "--optimize") {
+            optimize = value != "0";
+        } else {
+            std::cerr << "unknown option: " << name << std::endl;
+            return 1;
+        }
+    }
+    auto extension = inputPath.substr(inputPath.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (extension != "obj") {
+        std::cerr << "unsupported input format: " << extension << " (only .obj is supported)" << std::endl;
+        return 1;
+    }
+
+    std::vector<SourceVertex> soup;
+    if (!ParseObj(inputPath, soup)) {
+        std::cerr << "failed to read " << inputPath << std::endl;
+        return 1;
+    }
+    if (soup.empty()) {
+        std::cerr << "no triangles in " << inputPath << std::endl;
+        return 1;
+    }
+
+    // 先投影到二维再合并：只有z不一样的顶点投影之后完全相同，合并之后才不会在文件里留下重复的顶点
+    // 按xy的包围盒缩放到[-0.9, 0.9]，保持长宽比；Vulkan的y轴朝下，所以y取反，逆时针的正面正好变成管线要的顺时针
+    float minXY[2] = { soup[0].pos[0], soup[0].pos[1] };
+    float maxXY[2] = { minXY[0], minXY[1] };
+    for (const auto& vertex : soup) {
+        for (int axis = 0; axis < 2; ++axis) {
+            minXY[axis] = std::min(minXY[axis], vertex.pos[axis]);
+            maxXY[axis] = std::max(maxXY[axis], vertex.pos[axis]);
+        }
+    }
+    auto size = std::max({ maxXY[0] - minXY[0], maxXY[1] - minXY[1], 1e-6f });
+    auto scale = 1.8f / size;
+    std::vector<OutputVertex> projected(soup.size());
+    for (size_t i = 0; i < soup.size(); ++i) {
+        projected[i].pos[0] = (soup[i].pos[0] - (minXY[0] + maxXY[0]) * 0.5f) * scale;
+        projected[i].pos[1] = -(soup[i].pos[1] - (minXY[1] + maxXY[1]) * 0.5f) * scale;
+        std::copy(soup[i].color, soup[i].color + 3, projected[i].color);
+    }
+
+    auto welded = MeshWelder::Weld(projected.data(), projected.size());
+    auto& output = welded.vertices;
+    auto& indices = welded.indices;
+    std::cout << "Welded " << projected.size() << " vertices into " << output.size() << std::endl;
+    if (optimize) {
+        auto before = MeshOptimizer::AnalyzeVertexCache(indices, output.size());
+        indices = MeshOptimizer::OptimizeVertexCache(indices, output.size(), MeshOptimizer::DEFAULT_CACHE_SIZE);
+        output = MeshOptimizer::OptimizeVertexFetch(indices, output);
+        auto after = MeshOptimizer::AnalyzeVertexCache(indices, output.size());
+        std::cout << "ACMR " << before.acmr << " -> " << after.acmr << ", ATVR " << before.atvr << " -> " << after.atvr << std::endl;
+    }
+
+    MeshFileHeader header;
+    for (size_t i = 0; i < output.size(); ++i) {
+        for (int axis = 0; axis < 2; ++axis) {
+            header.boundsMin[axis] = i == 0 ? output[i].pos[axis] : std::min(header.boundsMin[axis], output[i].pos[axis]);
+            header.boundsMax[axis] = i == 0 ? output[i].pos[axis] : std::max(header.boundsMax[axis], output[i].pos[axis]);
+        }
+    }
+
+    auto indexType = MeshWelder::IndexTypeFor(output.size());
+    auto packedIndices = MeshWelder::PackIndices(indices, indexType);
+    header.vertexStride = sizeof(OutputVertex);
+    header.vertexCount = static_cast<uint32_t>(output.size());
+    header.indexCount = static_cast<uint32_t>(indices.size());
+    header.indexType = static_cast<uint32_t>(indexType);
+    header.attributeCount = 2;
+    header.attributes[0] = { 0, static_cast<uint32_t>(vk::Format::eR32G32Sfloat), static_cast<uint32_t>(offsetof(OutputVertex, pos)) };
+    header.attributes[1] = { 1, static_cast<uint32_t>(vk::Format::eR32G32B32Sfloat), static_cast<uint32_t>(offsetof(OutputVertex, color)) };
+    try {
+        MeshFile::Write(outputPath, header, output.data(), packedIndices.data());
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << outputPath << ": " << header.vertexCount << " vertices, " << header.indexCount / 3 << " triangles, "
+              << (indexType == vk::IndexType::eUint16 ? "16" : "32") << "-bit indices" << std::endl;
+    return 0;
+}